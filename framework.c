@@ -1,28 +1,452 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "framework.h"
+
+// The set kernels have AVX2 and AVX-512 versions on x86-64, picked at startup
+// from what the CPU supports. -DNO_SIMD_KERNELS keeps only the scalar ones.
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD_KERNELS)
+#define HAVE_SIMD_KERNELS
+#include <immintrin.h>
+#endif
 
 #define MAX_FILE_NAME_SIZE 128
-#define MAX_ROLES 1000
 
-FILE *openFile(char *fileName, char *mode);
+// Room for the message of an error returned instead of printed.
+#define ERROR_SIZE 256
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+// The sparse representation is used when fewer than one cell in
+// SPARSE_DENSITY_RATIO is an edge.
+#define SPARSE_DENSITY_RATIO 32
+
+// Candidate scans shorter than this run on the calling thread alone.
+#define PARALLEL_SCAN_MIN_CANDIDATES 256
+
+// Built with -DFRAMEWORK_LIBRARY the file leaves out main and the code only
+// the command line uses, and is used through the calls of framework.h, which
+// then print nothing unless LOG_LEVEL is given.
+#if defined(FRAMEWORK_LIBRARY) && !defined(LOG_LEVEL)
+#define LOG_LEVEL LOG_QUIET
+#endif
+
+// Diagnostics are leveled and the level is fixed at compile time with
+// -DLOG_LEVEL=n. Messages above LOG_LEVEL compile to nothing, arguments
+// included, so the mining loops pay for none of them.
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL)
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    if (LOG_ENABLED(level)) {                                                  \
+      printf(__VA_ARGS__);                                                     \
+    }                                                                          \
+  } while (0)
+
+// Constraint pairs a benchmark sweeps when none are given with -m.
+#define BENCH_CONSTRAINTS                                                      \
+  "5:5,5:20,5:100,20:5,20:20,20:100,100:5,100:20,100:100"
+
+// Pieces of a ScratchArena start on cache-line boundaries.
+#define ARENA_ALIGNMENT 64
+
+#define WORD_BITS 64
+#define WORDS(bits) (((bits) + WORD_BITS - 1) / WORD_BITS)
+#define GET_BIT(set, i) (((set)[(i) / WORD_BITS] >> ((i) % WORD_BITS)) & 1)
+#define SET_BIT(set, i)                                                        \
+  ((set)[(i) / WORD_BITS] |= (uint64_t)1 << ((i) % WORD_BITS))
+#define CLEAR_BIT(set, i)                                                      \
+  ((set)[(i) / WORD_BITS] &= ~((uint64_t)1 << ((i) % WORD_BITS)))
+#define ROW(matrix, i) ((matrix)->bits + (size_t)(i) * (matrix)->words)
+
+// Row-major bit matrix, each row padded to a whole number of 64-bit words so
+// that set operations on rows can run a word at a time.
+typedef struct BitMatrix {
+  int rows;
+  int cols;
+  int words;
+  uint64_t *bits;
+} BitMatrix;
+
+// Compressed sparse rows (user -> permissions) and columns (permission ->
+// users) of the same edge set. Both are sorted by index. CSC entry k is the
+// edge stored at CSR position csrPositions[k], so per-edge state indexed by
+// CSR position serves both views.
+typedef struct SparseMatrix {
+  int rows;
+  int cols;
+  int edges;
+  int *rowOffsets;
+  int *colIndices;
+  int *colOffsets;
+  int *rowIndices;
+  int *csrPositions;
+} SparseMatrix;
+
+// Binary UA/PA output is OUTPUT_MAGIC, rows, cols, then each row as
+// WORDS(cols) 64-bit words in host byte order.
+#define OUTPUT_MAGIC 0x314d4252 // "RBM1"
+
+// Output stream with a large buffer of its own, gzip-compressed when gz is
+// set.
+typedef struct OutputFile {
+  FILE *file;
+  void *gz;
+  char *buffer;
+  size_t length;
+} OutputFile;
+
+// A set of user-permission edges held either as a bit matrix or as a sparse
+// matrix with one mask bit per edge. A dense UPA also keeps its transpose,
+// updated alongside it, so permission columns are contiguous bit rows.
+// Copies of a sparse UPA share its structure and own only the mask, which is
+// how UC tracks coverage of V. A UPA loaded from a snapshot points into the
+// read-only mapping of the file.
+typedef struct UPA {
+  int userCount;
+  int permissionCount;
+  BitMatrix *matrix;
+  BitMatrix *transpose;
+  SparseMatrix *sparse;
+  uint64_t *edgeMask;
+  int ownsSparse;
+  void *mapping;
+  size_t mappingSize;
+} UPA;
+
+// Binary UPA snapshot, in host byte order: SnapshotHeader, then for a sparse
+// UPA rowOffsets, colIndices, colOffsets, rowIndices and csrPositions as
+// 32-bit integers, or for a dense one the matrix and transpose bit rows.
+// Every section starts on an 8-byte boundary.
+#define SNAPSHOT_MAGIC 0x53415055 // "UPAS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+  int32_t magic;
+  int32_t version;
+  int32_t format;
+  int32_t userCount;
+  int32_t permissionCount;
+  int32_t edges;
+  int32_t reserved[2];
+} SnapshotHeader;
+
+static FILE *openFile(char *fileName, char *mode);
+
+#ifndef FRAMEWORK_LIBRARY
+static char *getDatasetName(char *fileName);
+
+static OutputFile *openOutput(char *fileName, int compress);
+
+static void flushOutput(OutputFile *out);
+
+static void writeOutput(OutputFile *out, const void *data, size_t size);
+
+static void closeOutput(OutputFile *out);
+
+static void writeMatrixToFile(int rows, int cols, int *offsets, int *indices,
+                              char *fileName, Options *options);
+
+static void writeMatrixTransposeToFile(int rows, int cols, int *offsets,
+                                       int *indices, char *fileName,
+                                       Options *options);
+
+static void roleFileName(char *fileName, char *dataset, const char *matrix,
+                         Options *options);
+#endif
+
+static char *readFileContents(char *fileName, int compress, size_t *size);
+
+#ifndef FRAMEWORK_LIBRARY
+static void readMatrixFile(char *fileName, Options *options, int *rows,
+                           int *cols, int **offsets, int **indices);
+#endif
+
+static BitMatrix *allocateMatrix(int rows, int cols);
+
+static BitMatrix *createMatrix(int rows, int cols);
+
+static void freeMatrix(BitMatrix *matrix);
+
+static BitMatrix *copyMatrix(BitMatrix *matrix);
+
+static BitMatrix *transposeMatrix(BitMatrix *matrix);
+
+static SparseMatrix *createSparseMatrix(int rows, int cols, int edgeCount,
+                                        int *edgeRows, int *edgeCols);
+
+static void freeSparseMatrix(SparseMatrix *matrix);
+
+// Edges parsed by one loader thread from the lines in [begin, end). error
+// points at the first line that could not be used, if any.
+typedef struct EdgeChunk {
+  const char *begin;
+  const char *end;
+  int userCount;
+  int permissionCount;
+  int count;
+  int capacity;
+  int *users;
+  int *permissions;
+  const char *error;
+  const char *problem;
+  BitMatrix *matrix;
+} EdgeChunk;
+
+static UPA *loadUPA(char *fileName, enum UPAFormat format, int threadCount,
+                    int *userCount, int *permissionCount, char *error);
+
+static void freeEdgeChunks(EdgeChunk *chunks, int count);
+
+static const char *parseIndex(const char *p, const char *end, long *value);
+
+static const char *skipBlanks(const char *p, const char *end);
+
+static void parseEdgeChunk(void *arg, int worker, int workerCount);
+
+static void scatterEdgeChunk(void *arg, int worker, int workerCount);
+
+static void describeParseError(char *error, char *fileName, const char *data,
+                               const char *position, const char *problem);
+
+#ifndef FRAMEWORK_LIBRARY
+static void reportParseError(char *fileName, const char *data,
+                             const char *position, const char *problem);
+
+static void writeSnapshot(UPA *upa, char *fileName);
+
+static void writeSection(OutputFile *out, const void *data, size_t size);
+#endif
+
+static UPA *mapSnapshot(char *fileName, void *data, size_t size, char *error);
+
+static const void *snapshotSection(const char **cursor, const char *end,
+                                   size_t size);
+
+static int checkSnapshotOffsets(const int *offsets, int count, int edges);
+
+static int checkSnapshotIndices(const int *offsets, const int *indices,
+                                int count, int limit);
+
+static int checkSnapshotPositions(SparseMatrix *sparse);
+
+static int checkSnapshotBits(BitMatrix *matrix);
+
+static int checkSnapshotTranspose(UPA *upa, int edges);
+
+static enum UPAFormat chooseFormat(long edgeCount, int userCount,
+                                   int permissionCount);
+
+static int initEdgeMask(UPA *upa);
+
+// Synthetic UPA with planted roles, for benchmarking. Each role is given
+// permissionsPerRole random permissions and each user rolesPerUser random
+// roles, so rolesPerUser sets how much roles overlap on users and the two
+// together set the density. The same seed always gives the same UPA.
+typedef struct BenchSpec {
+  int userCount;
+  int permissionCount;
+  int roleCount;
+  int rolesPerUser;
+  int permissionsPerRole;
+  uint64_t seed;
+} BenchSpec;
+
+#ifndef FRAMEWORK_LIBRARY
+static int parseBenchSpec(char *spec, BenchSpec *bench);
+
+static UPA *generateUPA(BenchSpec *bench, enum UPAFormat format);
+#endif
+
+static UPA *buildUPA(int userCount, int permissionCount, long edgeCount,
+                     int *edgeUsers, int *edgePermissions,
+                     enum UPAFormat format);
+
+static UPA *finishBuiltUPA(UPA *upa);
+
+// A UPA with the users of equal rows collapsed into one user, and then the
+// permissions of equal columns into one permission. Collapsed vertices are
+// numbered in the order of their first members; userIds holds the first
+// member of each, userWeights the number of members, and userMembers, from
+// userMemberOffsets, the members in order. Likewise for permissions.
+typedef struct Reduction {
+  UPA *upa;
+  int *userIds;
+  int *permIds;
+  int *userWeights;
+  int *permWeights;
+  int *userMemberOffsets;
+  int *userMembers;
+  int *permMemberOffsets;
+  int *permMembers;
+} Reduction;
+
+static Reduction *reduceUPA(UPA *upa, enum UPAFormat format);
+
+static int groupEqualLists(int count, int *offsets, int *elements,
+                           int *classes);
 
-char *getDatasetName(char *fileName);
+static void listMembers(int count, int *classes, int classCount, int **ids,
+                        int **weights, int **memberOffsets, int **members);
 
-void writeMatrixToFile(int **matrix, int rows, int cols, char *fileName);
+static void freeReduction(Reduction *reduction);
 
-void writeMatrixTransposeToFile(int **matrix, int rows, int cols,
-                                char *fileName);
+// Roles of a previous run on the same dataset that a delta of added and
+// removed edges leaves valid, for mineRoles to start from. A role is dropped
+// if it holds a removed edge; the users of dropped roles and those with added
+// edges are the affected users, the only ones whose edges may be left
+// uncovered. userRoleOffsets/userRoles list the kept roles of each user.
+// mrcUser and mrcPerm are the constraints the roles were mined for, or 0 if
+// -u was not told them.
+typedef struct PriorRoles {
+  struct RoleStore *kept;
+  int mrcUser;
+  int mrcPerm;
+  int dropped;
+  int affectedCount;
+  uint64_t *affectedUsers;
+  int *userRoleOffsets;
+  int *userRoles;
+} PriorRoles;
 
-void freeMatrix(int **upaMatrix, int userCount);
+#ifndef FRAMEWORK_LIBRARY
+static uint64_t nextRandom(uint64_t *state);
+#endif
 
-int **readUPAMatrix(FILE *f, int userCount, int permissionCount);
+static UPA *copyUPA(UPA *upa);
 
-int **copyMatrix(int **matrix, int rows, int cols);
+static void freeUPA(UPA *upa);
 
-int isSubset(int *uc, int *p, int size);
+static int countEdges(UPA *upa);
 
-int hasElement(int *uc, int *p, int size);
+static int rowStart(UPA *upa, int i);
+
+static int rowEnd(UPA *upa, int i);
+
+static int cellColumn(UPA *upa, int k);
+
+static int isRowCellSet(UPA *upa, int i, int k);
+
+static int columnStart(UPA *upa, int j);
+
+static int columnEnd(UPA *upa, int j);
+
+static int cellRow(UPA *upa, int k);
+
+static int isColumnCellSet(UPA *upa, int j, int k);
+
+static int getRowElements(UPA *upa, int i, int *elements);
+
+static int getColumnElements(UPA *upa, int j, int *elements);
+
+#ifndef FRAMEWORK_LIBRARY
+static int hasEdge(UPA *upa, int i, int j);
+#endif
+
+static int countRowElements(UPA *upa, int i, uint64_t *filter, int *weights);
+
+static int countColumnElements(UPA *upa, int j, uint64_t *filter, int *weights);
+
+static void classifySparseRow(UPA *V, UPA *UC, int i, uint64_t *set,
+                              int setSize, int *inV, int *meetsUC,
+                              int *ucWithinSet);
+
+static void classifySparseColumn(UPA *V, UPA *UC, int j, uint64_t *set,
+                                 int setSize, int *inV, int *meetsUC,
+                                 int *ucWithinSet);
+
+static int isSubset(uint64_t *a, uint64_t *b, int words);
+
+static int hasElement(uint64_t *a, uint64_t *b, int words);
+
+// Implementations of isSubset and hasElement for one instruction set. Both
+// stop at the first word that decides the answer.
+typedef struct SetKernels {
+  const char *name;
+  int (*isSubset)(uint64_t *a, uint64_t *b, int words);
+  int (*hasElement)(uint64_t *a, uint64_t *b, int words);
+} SetKernels;
+
+static void selectSetKernels(void);
+
+static int isSubsetScalar(uint64_t *a, uint64_t *b, int words);
+
+static int hasElementScalar(uint64_t *a, uint64_t *b, int words);
+
+#ifdef HAVE_SIMD_KERNELS
+static int isSubsetAvx2(uint64_t *a, uint64_t *b, int words);
+
+static int hasElementAvx2(uint64_t *a, uint64_t *b, int words);
+
+static int isSubsetAvx512(uint64_t *a, uint64_t *b, int words);
+
+static int hasElementAvx512(uint64_t *a, uint64_t *b, int words);
+#endif
+
+#ifndef FRAMEWORK_LIBRARY
+// Checks every set kernel the CPU can run, and the isSubset and hasElement
+// dispatch, against the scalar kernels on random sets of 0 to
+// SET_KERNEL_TEST_WORDS words. Returns the number of mismatches.
+#define SET_KERNEL_TEST_WORDS 40
+#define SET_KERNEL_TEST_ROUNDS 2000
+
+static int testSetKernels(void);
+
+static int testSetKernel(SetKernels *kernels, uint64_t *seed);
+#endif
+
+struct WorkerPool;
+
+typedef struct PoolWorker {
+  struct WorkerPool *pool;
+  int index;
+  pthread_t thread;
+} PoolWorker;
+
+// Threads kept for the whole run. runOnPool calls job(arg, worker,
+// workerCount) once per worker, the calling thread being worker 0, and
+// returns when every call has finished.
+typedef struct WorkerPool {
+  int threadCount;
+  PoolWorker *workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  void (*job)(void *arg, int worker, int workerCount);
+  void *arg;
+  int generation;
+  int pending;
+  int stopping;
+} WorkerPool;
+
+static WorkerPool *createWorkerPool(int threadCount);
+
+static void freeWorkerPool(WorkerPool *pool);
+
+static void *poolWorker(void *arg);
+
+static void runOnPool(WorkerPool *pool, void (*job)(void *, int, int),
+                      void *arg);
 
 enum VertexType { USER, PERMISSION };
 
@@ -31,800 +455,5710 @@ typedef struct Vertex {
   enum VertexType type;
 } Vertex;
 
-Vertex selectVertexWithHeuristic(int **UC, int mrcUser, int mrcPerm,
-                                 int *userRoleCount, int *permRoleCount,
-                                 int userCount, int permissionCount);
+// Tournament tree over the vertices of one side of the graph. Each internal
+// node holds the index of the smallest key below it, ties going to the lower
+// index, so the minimum is read at the root and a key change costs O(log n).
+typedef struct TournamentTree {
+  int size;
+  int leaves;
+  int *keys;
+  int *winners;
+} TournamentTree;
 
-Vertex selectVertexWithMaxUncoveredIncidentEdges(int **UC, int userCount,
-                                                 int permissionCount,
-                                                 int *userRoleCount,
-                                                 int *permRoleCount,
-                                                 int mrcUser, int mrcPerm);
+// Uncovered-edge counts kept up to date as edges are covered and role counts
+// change, so vertex selection does not rescan UC. userDegree/permDegree count
+// uncovered edges whose other end can still take a role (the Phase 1 score);
+// userUncovered/permUncovered count all uncovered edges (the Phase 2 score).
+// When UC is a collapsed UPA each edge counts as many times as the vertex at
+// its other end stands for, per userWeights and permWeights (NULL for one).
+typedef struct DegreeIndex {
+  int userCount;
+  int permissionCount;
+  int mrcUser;
+  int mrcPerm;
+  int *userRoleCount;
+  int *permRoleCount;
+  int *userUncovered;
+  int *permUncovered;
+  int *userDegree;
+  int *permDegree;
+  int *userWeights;
+  int *permWeights;
+  int *elements;
+  TournamentTree *fewestUser;
+  TournamentTree *fewestPerm;
+  TournamentTree *mostUser;
+  TournamentTree *mostPerm;
+} DegreeIndex;
 
-int hasUncoveredEdges(int **UC, int userCount, int permissionCount);
+static TournamentTree *createTournamentTree(int size);
 
-int concurrentProcessingFramework(int **upaMatrix, int userCount,
-                                  int permissionCount, int mrcUser,
-                                  int mrcPermission, char *dataset);
+static void freeTournamentTree(TournamentTree *tree);
 
-int modifyUC(int **UC, int *U, int *P, int userCount, int permissionCount);
+static int playMatch(TournamentTree *tree, int a, int b);
 
-int uniqueRole(int *U, int *P, int **uaMatrix, int **paMatrix, int userCount,
-               int roleCount, int permissionCount);
+static void rebuildTournamentTree(TournamentTree *tree);
 
-int isSetEmpty(int *a, int size);
+static void updateTournamentTree(TournamentTree *tree, int i, int key);
 
-void addRoletoUA(int **uaMatrix, int *U, int userCount, int roleCount);
+static int tournamentWinner(TournamentTree *tree);
 
-void addRoletoPA(int **paMatrix, int *P, int permissionCount, int roleCount);
+// Input of the initial scoring pass. Each worker scores its own ranges of
+// users and permissions, so the DegreeIndex is written without locking.
+typedef struct ScoringJob {
+  DegreeIndex *degrees;
+  UPA *UC;
+  uint64_t *eligibleUsers;
+  uint64_t *eligiblePerms;
+} ScoringJob;
 
-void formRoleProcedure(int v, int userCount, int permissionCount,
-                       int U[userCount], int P[permissionCount], int **UC,
-                       int **V, int mrcUser, int mrcPerm, int *userRoleCount,
-                       int *permRoleCount, int **uaMatrix, int **paMatrix,
-                       int *roleCount);
+static DegreeIndex *createDegreeIndex(UPA *UC, int *userRoleCount,
+                                      int *permRoleCount, int mrcUser,
+                                      int mrcPerm, int *userWeights,
+                                      int *permWeights, WorkerPool *pool);
 
-void dualFormRoleProcedure(int v, int *U, int *P, int **UC, int **V,
-                           int mrcUser, int mrcPerm, int *userRoleCount,
-                           int *permRoleCount, int **uaMatrix, int **paMatrix,
-                           int userCount, int permissionCount, int *roleCount);
+static void scoreVertices(void *arg, int worker, int workerCount);
 
-int main() {
-  char upaFile[MAX_FILE_NAME_SIZE];
-  printf("Enter the name of the UPA matrix file: ");
-  scanf("%s", upaFile);
+static int fewestKey(int degree);
 
-  FILE *f = openFile(upaFile, "r");
+static int mostKey(int uncovered, int roleCount, int mrc);
 
-  int userCount, permissionCount;
-  fscanf(f, "%d", &userCount);
-  fscanf(f, "%d", &permissionCount);
+static void freeDegreeIndex(DegreeIndex *degrees);
 
-  int **upaMatrix = readUPAMatrix(f, userCount, permissionCount);
+static void refreshUserDegree(DegreeIndex *degrees, int i);
 
-  fclose(f);
+static void refreshPermDegree(DegreeIndex *degrees, int j);
 
-  char *dataset = getDatasetName(upaFile);
+static void coverEdge(DegreeIndex *degrees, int i, int j);
 
-  int mrcUser, mrcPermission;
+static void setUserRoleCount(DegreeIndex *degrees, UPA *UC, int i, int count);
 
-  printf("Enter the value of the role-usage cardinality constraint: ");
-  scanf("%d", &mrcUser);
+static void setPermRoleCount(DegreeIndex *degrees, UPA *UC, int j, int count);
 
-  printf("Enter the value of the permission-distribution cardinality "
-         "constraint: ");
-  scanf("%d", &mrcPermission);
+static Vertex selectVertexWithHeuristic(DegreeIndex *degrees);
 
-  int roleCount = concurrentProcessingFramework(
-      upaMatrix, userCount, permissionCount, mrcUser, mrcPermission, dataset);
+static Vertex selectVertexWithMaxUncoveredIncidentEdges(DegreeIndex *degrees);
 
-  freeMatrix(upaMatrix, userCount);
-  free(dataset);
+// Position of a phase in its row-major walk over the uncovered edges of UC:
+// the next cell to visit is cell of row user, which has been visited visits
+// times already. A rewinding cursor starts over at the end of a walk as long
+// as the walk covered some of the passEdges edges uncovered at its start.
+typedef struct EdgeCursor {
+  int user;
+  int cell;
+  long visits;
+  int rewind;
+  int passEdges;
+} EdgeCursor;
+
+static void startEdgeCursor(EdgeCursor *cursor, UPA *UC, int rewind);
+
+static int nextPhaseEdge(EdgeCursor *cursor, UPA *UC, DegreeIndex *degrees,
+                         int phase);
+
+static int visitCursorEdge(EdgeCursor *cursor, UPA *UC, DegreeIndex *degrees);
+
+static int mayHavePhaseEdge(DegreeIndex *degrees, int phase, int i);
+
+static long nextSetBit(uint64_t *bits, long from, long end);
+
+static int hasUncoveredEdges(UPA *UC);
+
+// Timings and counters of one concurrentProcessingFramework run, written to
+// <dataset>_stats.json when -r is given. Times are in seconds of the monotonic
+// clock; loadSeconds is filled in by the caller.
+typedef struct RunStats {
+  double loadSeconds;
+  double phaseSeconds[2];
+  double outputSeconds;
+  double totalSeconds;
+  int edges;
+  int uncoveredEdges;
+  int selections[2];
+  int formRoleCalls;
+  int dualFormRoleCalls;
+  int roleCount;
+  int duplicateRoles;
+  int emptyRoles;
+  int minCoveredEdges;
+  int maxCoveredEdges;
+  long coveredEdges;
+  int speculationRounds;
+  int speculationHits;
+  int speculationRedrafts;
+  int components;
+  int collapsedUsers;
+  int collapsedPermissions;
+  int keptRoles;
+  int droppedRoles;
+  int affectedUsers;
+  int minedFromScratch;
+  long peakResidentKiB;
+} RunStats;
+
+static double monotonicSeconds(void);
+
+static void countCoveredEdges(RunStats *stats, int covered);
+
+#ifndef FRAMEWORK_LIBRARY
+static void writeStatsReport(char *fileName, char *dataset, int userCount,
+                             int permissionCount, int mrcUser,
+                             int mrcPermission, Options *options,
+                             RunStats *stats);
+
+static void writeJsonString(FILE *file, const char *string);
+
+static int concurrentProcessingFramework(UPA *upa, int userCount,
+                                         int permissionCount, int mrcUser,
+                                         int mrcPermission, char *dataset,
+                                         Options *options,
+                                         struct Reduction *reduction,
+                                         struct PriorRoles *prior,
+                                         char **unenforced, RunStats *stats);
+#endif
+
+static struct RoleStore *mineUPA(UPA *upa, int mrcUser, int mrcPermission,
+                                 Options *options, struct Reduction *reduction,
+                                 struct PriorRoles *prior, char **unenforced,
+                                 RunStats *stats);
+
+static struct RoleStore *mineRoles(UPA *upa, int mrcUser, int mrcPermission,
+                                   Options *options, int *userIds, int *permIds,
+                                   int *userWeights, int *permWeights,
+                                   struct PriorRoles *prior, FILE *unenforced,
+                                   RunStats *stats);
+
+// A connected component of the user-permission graph, mined as a UPA of its
+// own. userIds and permIds map its local indices back to those of the whole
+// UPA; both are increasing, so local order follows global order.
+typedef struct Component {
+  UPA *upa;
+  long edges;
+  int *userIds;
+  int *permIds;
+  int *userWeights;
+  int *permWeights;
+  struct RoleStore *roles;
+  RunStats stats;
+  char *unenforced;
+  size_t unenforcedSize;
+} Component;
+
+// Components mined in parallel, each worker claiming the next of order, which
+// lists the components largest first.
+typedef struct ComponentJob {
+  Component **order;
+  int count;
+  int next;
+  int mrcUser;
+  int mrcPermission;
+  Options *options;
+  int *userIds;
+  int *permIds;
+} ComponentJob;
+
+static struct RoleStore *mineComponents(UPA *upa, int mrcUser,
+                                        int mrcPermission, Options *options,
+                                        int *userIds, int *permIds,
+                                        int *userWeights, int *permWeights,
+                                        FILE *unenforced, RunStats *stats);
+
+static int findComponents(UPA *upa, int *userComponent, int *permComponent);
+
+static int findRoot(int *parent, int v);
+
+static Component *splitComponents(UPA *upa, int *userComponent,
+                                  int *permComponent, int count,
+                                  int *userWeights, int *permWeights,
+                                  enum UPAFormat format);
+
+static int compareComponents(const void *a, const void *b);
+
+static void mineComponent(void *arg, int worker, int workerCount);
+
+static void mergeRunStats(RunStats *total, RunStats *part);
+
+// A batch of (mrcUser, mrcPermission) pairs mined from one loaded UPA. Each
+// worker claims the next pair until none are left; the runs only read the
+// UPA, so they share it. What a pair cannot cover goes to its unenforced
+// entry, printed with its result once all pairs are done.
+typedef struct Sweep {
+  UPA *upa;
+  struct Reduction *reduction;
+  struct PriorRoles *prior;
+  int userCount;
+  int permissionCount;
+  char *dataset;
+  Options *options;
+  double loadSeconds;
+  int *constraints;
+  int count;
+  int next;
+  RunStats *stats;
+  char **unenforced;
+} Sweep;
+
+#ifndef FRAMEWORK_LIBRARY
+static int parseConstraints(const char *list, int **constraints, int *count);
+
+static void addConstraints(int **constraints, int *count, int mrcUser,
+                           int mrcPermission);
 
-  if (roleCount != -1) {
-    printf("Number of roles = %d\n", roleCount);
+static void runSweep(void *arg, int worker, int workerCount);
+
+static void printBenchReport(BenchSpec *bench, Sweep *sweep);
+#endif
+
+static int modifyUC(UPA *UC, int *users, int userCount, uint64_t *P,
+                    DegreeIndex *degrees);
+
+// Open-addressing hash table from role hashes to role indices, so that
+// uniqueRole only compares roles whose hashes are equal.
+typedef struct RoleDictionary {
+  int capacity;
+  int size;
+  uint64_t *hashes;
+  int *roles;
+} RoleDictionary;
+
+static RoleDictionary *createRoleDictionary(int capacity);
+
+static void freeRoleDictionary(RoleDictionary *dictionary);
+
+static uint64_t mixHash(uint64_t hash, uint64_t value);
+
+static uint64_t hashRole(int *users, int userCount, int *permissions,
+                         int permissionCount);
+
+static void insertRole(RoleDictionary *dictionary, uint64_t hash, int role);
+
+// Roles formed so far, one after another. Role r holds the users
+// users[userOffsets[r]] .. users[userOffsets[r + 1] - 1] and likewise for
+// permissions, both sorted. All arrays grow by doubling, so memory follows
+// the roles actually formed.
+typedef struct RoleStore {
+  int userCount;
+  int permissionCount;
+  int count;
+  int capacity;
+  int *userOffsets;
+  int *permOffsets;
+  int userCapacity;
+  int permCapacity;
+  int *users;
+  int *permissions;
+  RoleDictionary *dictionary;
+  int duplicates;
+  int empty;
+} RoleStore;
+
+static RoleStore *createRoleStore(int userCount, int permissionCount);
+
+static void freeRoleStore(RoleStore *roles);
+
+static RoleStore *expandRoles(RoleStore *roles, Reduction *reduction,
+                              int userCount, int permissionCount);
+
+static int appendMembers(int **members, int *capacity, int length, int *added,
+                         int count);
+
+static void addRole(RoleStore *roles, int *users, int userCount,
+                    int *permissions, int permissionCount, uint64_t hash);
+
+static int uniqueRole(int *users, int userCount, int *permissions,
+                      int permissionCount, uint64_t hash, RoleStore *roles);
+
+#ifndef FRAMEWORK_LIBRARY
+static PriorRoles *loadPriorRoles(UPA *upa, char *dataset, Options *options);
+
+static void readDelta(char *fileName, UPA *upa, uint64_t *affectedUsers,
+                      int **removed, int *removedCount);
+
+static int parseDeltaSpec(char *spec, int *mrcUser, int *mrcPerm);
+#endif
+
+static void seedPriorRoles(PriorRoles *prior, UPA *UC, RoleStore *roles,
+                           int *userRoleCount, int *permRoleCount);
+
+static int rolesFit(RoleStore *roles, int mrcUser, int mrcPerm);
+
+#ifndef FRAMEWORK_LIBRARY
+static void freePriorRoles(PriorRoles *prior);
+#endif
+
+// Checkpoint of a mineRoles run, in host byte order: CheckpointHeader, the
+// RunStats so far, the UC edge mask (the edgeMask of a sparse UPA, the matrix
+// bits of a dense one) and then as 32-bit integers the user and permission
+// role counts, the role user and permission offsets, and the role users and
+// permissions. Every section starts on an 8-byte boundary.
+#define CHECKPOINT_MAGIC 0x4b43524d // "MRCK"
+#define CHECKPOINT_VERSION 1
+
+typedef struct CheckpointHeader {
+  int32_t magic;
+  int32_t version;
+  int32_t userCount;
+  int32_t permissionCount;
+  int32_t mrcUser;
+  int32_t mrcPerm;
+  uint64_t fingerprint;
+  int32_t statsSize;
+  int32_t phase;
+  int32_t loopCount;
+  int32_t roleCount;
+  int32_t roleUsers;
+  int32_t rolePermissions;
+  int32_t duplicateRoles;
+  int32_t emptyRoles;
+  int32_t cursorUser;
+  int32_t cursorCell;
+  int64_t cursorVisits;
+  int32_t cursorRewind;
+  int32_t cursorPassEdges;
+  int64_t maskWords;
+  double phaseSeconds;
+} CheckpointHeader;
+
+// Periodic checkpoints of one mineRoles run, due every everyRoles roles or
+// everySeconds seconds, whichever is set. The run's state is copied into
+// buffer between two loop iterations, and a background thread writes it to
+// <fileName>.tmp and renames that over fileName, so the file always holds a
+// whole checkpoint while mining goes on.
+typedef struct Checkpoint {
+  char *fileName;
+  int everyRoles;
+  int everySeconds;
+  int nextRoles;
+  double nextTime;
+  uint64_t fingerprint;
+  int mrcUser;
+  int mrcPerm;
+  UPA *UC;
+  int *userRoleCount;
+  int *permRoleCount;
+  RoleStore *roles;
+  EdgeCursor *cursor;
+  RunStats *stats;
+  char *buffer;
+  size_t capacity;
+  size_t length;
+  pthread_t writer;
+  int writing;
+} Checkpoint;
+
+#ifndef FRAMEWORK_LIBRARY
+static int parseCheckpointInterval(char *spec, Options *options);
+#endif
+
+static uint64_t fingerprintUPA(UPA *upa);
+
+static Checkpoint *createCheckpoint(Options *options, UPA *upa, int mrcUser,
+                                    int mrcPerm, UPA *UC, int *userRoleCount,
+                                    int *permRoleCount, RoleStore *roles,
+                                    EdgeCursor *cursor, RunStats *stats);
+
+static void checkpointRun(Checkpoint *checkpoint, int phase, int loopCount,
+                          double phaseStart);
+
+static void putSection(char **cursor, const void *data, size_t size);
+
+static void *writeCheckpointFile(void *arg);
+
+static void resumeCheckpoint(Checkpoint *checkpoint, UPA *upa, int *phase,
+                             int *loopCount, double *phaseSeconds);
+
+static const char *restoreCheckpoint(Checkpoint *checkpoint, UPA *upa,
+                                     const char *data, size_t size, int *phase,
+                                     int *loopCount, double *phaseSeconds);
+
+static void finishCheckpoint(Checkpoint *checkpoint);
+
+// The library calls of framework.h work on a MiningContext. A run that
+// cannot meet its constraints leaves the uncovered vertices in unenforced.
+struct MiningContext {
+  Options options;
+  UPA *upa;
+  Reduction *reduction;
+  RoleStore *roles;
+  RunStats stats;
+  char *unenforced;
+  char error[ERROR_SIZE];
+};
+
+static void setMiningContextUPA(MiningContext *context, UPA *upa);
+
+#ifndef FRAMEWORK_LIBRARY
+// Mining daemon: listens on a Unix domain socket and keeps a MiningContext for
+// every UPA file it has been asked about, so requests pay for neither process
+// startup nor parsing. A request is one line, one of
+//   mine <file> <mrcUser> <mrcPermission>
+//   forget <file>
+//   shutdown
+// answered by a status line and as many lines again as it announces:
+//   ok <roles>, then per role its users, "|" and its permissions
+//   infeasible <lines>, then the uncovered vertices as the CLI prints them
+//   error <message>
+// Role members are 1-based, as in UPA files. Clients are served one at a
+// time, each for as many requests as it sends before closing its end.
+typedef struct DaemonCache {
+  char *fileName;
+  MiningContext *context;
+  struct DaemonCache *next;
+} DaemonCache;
+
+static int runDaemon(char *socketPath, Options *options);
+
+static int serveClient(int client, DaemonCache **cache, Options *options);
+
+static MiningContext *cachedContext(DaemonCache **cache, char *fileName,
+                                    Options *options, char *error);
+
+static int forgetContext(DaemonCache **cache, char *fileName);
+
+static void answerMining(FILE *out, MiningContext *context, int mrcUser,
+                         int mrcPermission);
+#endif
+
+static void printRoleState(uint64_t *U, uint64_t *P, int *userRoleCount,
+                           int *permRoleCount, int userCount,
+                           int permissionCount);
+
+// Memory for the temporary state of one run, taken in a single zeroed block
+// when the run starts. arenaAlloc hands out pieces of it, which stay valid
+// until the arena is freed, so role formation itself never allocates.
+typedef struct ScratchArena {
+  char *base;
+  size_t size;
+  size_t used;
+} ScratchArena;
+
+static ScratchArena *createScratchArena(size_t size);
+
+static void freeScratchArena(ScratchArena *arena);
+
+static void *arenaAlloc(ScratchArena *arena, size_t size);
+
+static size_t arenaSize(size_t size);
+
+// A role grown from one vertex but not yet committed. On commit the role count
+// of every member in userRaised/permRaised goes up by one, and that of the
+// vertex itself by one more. snapshot is the number of roles formed when the
+// draft was made.
+typedef struct RoleDraft {
+  Vertex vertex;
+  int mrcUser;
+  int mrcPerm;
+  int snapshot;
+  uint64_t *U;
+  uint64_t *P;
+  uint64_t *userRaised;
+  uint64_t *permRaised;
+  unsigned char *accepted;
+  // Undo log: every user and permission ever set in U or P since the last
+  // reset, each listed once, so that the draft is walked and cleared in time
+  // proportional to its size. After compactRoleDraft the lists are exactly
+  // the members of U and P in increasing order.
+  int *touchedUsers;
+  int *touchedPerms;
+  int touchedUserCount;
+  int touchedPermCount;
+  uint64_t *userTouched;
+  uint64_t *permTouched;
+} RoleDraft;
+
+static RoleDraft *createRoleDraft(ScratchArena *arena, int userCount,
+                                  int permissionCount);
+
+static size_t roleDraftSize(int userCount, int permissionCount);
+
+static void resetRoleDraft(RoleDraft *draft);
+
+static void addDraftMember(RoleDraft *draft, int permission, int i, int raised);
+
+static void compactRoleDraft(RoleDraft *draft);
+
+static int compareIndices(const void *a, const void *b);
+
+static void commitRoleCounts(DegreeIndex *degrees, UPA *UC, RoleDraft *draft);
+
+// Membership test of formRoleProcedure, which checks every candidate user
+// against set (tempP). In the dual the candidates are permissions and set is
+// tempU. Candidates are all vertices of that side, or for a sparse UPA the
+// neighbours of pivot. Each candidate is decided on its own, so the scan is
+// split across workers and the accepted flags are merged in candidate order.
+typedef struct CandidateScan {
+  UPA *V;
+  UPA *UC;
+  int dual;
+  int v;
+  uint64_t *set;
+  int setSize;
+  int mrc;
+  int *roleCount;
+  int pivot;
+  int candidates;
+  unsigned char *accepted;
+} CandidateScan;
+
+static void initCandidateScan(CandidateScan *scan, RoleDraft *draft, UPA *UC,
+                              UPA *V, int *userRoleCount, int *permRoleCount);
+
+static int candidateAt(CandidateScan *scan, int c);
+
+static int isCandidateAccepted(CandidateScan *scan, int i);
+
+static void scanCandidates(void *arg, int worker, int workerCount);
+
+static void selectCandidates(CandidateScan *scan, RoleDraft *draft,
+                             WorkerPool *pool);
+
+static void draftRole(RoleDraft *draft, Vertex vertex, UPA *UC, UPA *V,
+                      int mrcUser, int mrcPerm, int *userRoleCount,
+                      int *permRoleCount, int snapshot, WorkerPool *pool);
+
+static int reviseRoleDraft(RoleDraft *draft, UPA *UC, UPA *V,
+                           int *userRoleCount, int *permRoleCount,
+                           RoleStore *roles);
+
+static void printDraftState(RoleDraft *draft, int *userRoleCount,
+                            int *permRoleCount, int userCount,
+                            int permissionCount);
+
+static int commitRoleDraft(RoleDraft *draft, UPA *UC, DegreeIndex *degrees,
+                           RoleStore *roles);
+
+static void printUncoveredRow(UPA *UC, int v);
+
+static RoleDraft *formRoleProcedure(int v, UPA *UC, UPA *V, int mrcUser,
+                                    int mrcPerm, int *userRoleCount,
+                                    int *permRoleCount, DegreeIndex *degrees,
+                                    RoleStore *roles, RoleDraft *draft,
+                                    WorkerPool *pool);
+
+static RoleDraft *dualFormRoleProcedure(int v, UPA *UC, UPA *V, int mrcUser,
+                                        int mrcPerm, int *userRoleCount,
+                                        int *permRoleCount,
+                                        DegreeIndex *degrees, RoleStore *roles,
+                                        RoleDraft *draft, WorkerPool *pool);
+
+// Drafts for the depth vertices that Phase 1 is expected to select next, all
+// made against the state after the first snapshot roles were formed.
+typedef struct Speculation {
+  int depth;
+  int count;
+  int next;
+  int snapshot;
+  Vertex *vertices;
+  RoleDraft **drafts;
+  UPA *UC;
+  UPA *V;
+  int mrcUser;
+  int mrcPerm;
+  int *userRoleCount;
+  int *permRoleCount;
+  int rounds;
+  int hits;
+  int redrafts;
+} Speculation;
+
+static Speculation *createSpeculation(ScratchArena *arena, int depth, UPA *UC,
+                                      UPA *V, int mrcUser, int mrcPerm,
+                                      int *userRoleCount, int *permRoleCount);
+
+static void freeSpeculation(Speculation *speculation);
+
+static int nextVertices(DegreeIndex *degrees, Vertex *vertices, int count);
+
+static void draftSpeculatively(void *arg, int worker, int workerCount);
+
+static RoleDraft *speculativeFormRole(Speculation *speculation, Vertex vertex,
+                                      DegreeIndex *degrees, RoleStore *roles,
+                                      WorkerPool *pool);
+
+#ifndef FRAMEWORK_LIBRARY
+int main(int argc, char *argv[]) {
+  Options options = DEFAULT_OPTIONS;
+  selectSetKernels();
+  int *constraints = NULL, constraintCount = 0;
+  BenchSpec bench = {0};
+  int benchmark = 0;
+  char *socketPath = NULL;
+  int selfTest = 0;
+  int priorMrcUser = 0, priorMrcPerm = 0;
+
+  int option, valid = 1;
+  while ((option = getopt(argc, argv, "dst:k:o:zc:m:j:rg:peu:l:K:i:RT")) !=
+         -1) {
+    switch (option) {
+    case 'd':
+      options.format = DENSE;
+      break;
+    case 's':
+      options.format = SPARSE;
+      break;
+    case 't':
+      options.threadCount = atoi(optarg);
+      break;
+    case 'k':
+      options.speculationDepth = atoi(optarg);
+      break;
+    case 'o':
+      if (strcmp(optarg, "text") == 0) {
+        options.output = TEXT_OUTPUT;
+      } else if (strcmp(optarg, "edges") == 0) {
+        options.output = EDGE_OUTPUT;
+      } else if (strcmp(optarg, "binary") == 0) {
+        options.output = BINARY_OUTPUT;
+      } else {
+        valid = 0;
+      }
+      break;
+    case 'z':
+#ifdef HAVE_ZLIB
+      options.compress = 1;
+#else
+      fprintf(stderr, "-z needs a build with HAVE_ZLIB\n");
+      valid = 0;
+#endif
+      break;
+    case 'c':
+      options.snapshotFile = optarg;
+      break;
+    case 'm':
+      if (!parseConstraints(optarg, &constraints, &constraintCount)) {
+        valid = 0;
+      }
+      break;
+    case 'j':
+      options.jobCount = atoi(optarg);
+      break;
+    case 'r':
+      options.report = 1;
+      break;
+    case 'g':
+      benchmark = 1;
+      if (!parseBenchSpec(optarg, &bench)) {
+        valid = 0;
+      }
+      break;
+    case 'p':
+      options.components = 1;
+      break;
+    case 'e':
+      options.collapse = 1;
+      break;
+    case 'u':
+      if (!parseDeltaSpec(optarg, &priorMrcUser, &priorMrcPerm)) {
+        valid = 0;
+      }
+      options.deltaFile = optarg;
+      break;
+    case 'l':
+      socketPath = optarg;
+      break;
+    case 'K':
+      options.checkpointFile = optarg;
+      break;
+    case 'i':
+      if (!parseCheckpointInterval(optarg, &options)) {
+        valid = 0;
+      }
+      break;
+    case 'R':
+      options.resume = 1;
+      break;
+    case 'T':
+      selfTest = 1;
+      break;
+    default:
+      valid = 0;
+    }
+  }
+  int operands = argc - optind;
+  if (!valid || options.threadCount < 1 || options.speculationDepth < 1 ||
+      options.jobCount < 1 || (benchmark && operands != 0) ||
+      (operands != 0 && operands != 1 && operands != 3) ||
+      (options.deltaFile != NULL &&
+       (benchmark || options.components || options.collapse ||
+        constraintCount + (operands == 3) > 1)) ||
+      (selfTest && (argc != 2 || operands != 0)) ||
+      (options.resume && options.checkpointFile == NULL) ||
+      (options.checkpointFile != NULL &&
+       (benchmark || socketPath != NULL || options.components ||
+        options.deltaFile != NULL ||
+        constraintCount + (operands == 3) > 1)) ||
+      (socketPath != NULL &&
+       (benchmark || operands != 0 || constraintCount != 0 ||
+        options.deltaFile != NULL || options.snapshotFile != NULL))) {
+    fprintf(stderr,
+            "Usage: %s [-d | -s] [-t threads] [-k depth] "
+            "[-o text | edges | binary] [-z] [-c snapshot]\n"
+            "       [-m mrcUser:mrcPermission,...] [-j jobs] [-r] [-p] [-e]\n"
+            "       [-u delta[:mrcUser:mrcPermission]] "
+            "[-K checkpoint [-i roles | -i seconds s] [-R]]\n"
+            "       [file [mrcUser mrcPermission]]\n"
+            "       %s -g users:permissions:roles:rolesPerUser:"
+            "permissionsPerRole[:seed] [options]\n"
+            "       %s -l socket [options]\n"
+            "       %s -T\n"
+            "-u updates the roles of the last run, mined for the pair given, "
+            "for the edges\nin delta. An update that cannot meet the "
+            "constraints is discarded with a\nwarning and the UPA mined "
+            "from scratch.\n",
+            argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  // With -T the set kernels are checked against the scalar ones instead.
+  if (selfTest) {
+    return testSetKernels() ? 1 : 0;
   }
 
-  return 0;
-}
+  // With -l the process serves mining requests until told to stop.
+  if (socketPath != NULL) {
+    return runDaemon(socketPath, &options);
+  }
 
-FILE *openFile(char *fileName, char *mode) {
-  FILE *f = fopen(fileName, mode);
-  if (f == NULL) {
-    perror("Unable to open file: ");
-    exit(1);
+  // Whatever is not given on the command line is asked for.
+  char fileName[MAX_FILE_NAME_SIZE];
+  char *upaFile = fileName;
+  if (benchmark) {
+    sprintf(fileName, "bench_%d_%d_%d_%d_%d_%llu", bench.userCount,
+            bench.permissionCount, bench.roleCount, bench.rolesPerUser,
+            bench.permissionsPerRole, (unsigned long long)bench.seed);
+  } else if (operands > 0) {
+    upaFile = argv[optind];
+  } else {
+    printf("Enter the name of the UPA matrix file: ");
+    scanf("%s", fileName);
+  }
+  if (operands == 3) {
+    addConstraints(&constraints, &constraintCount, atoi(argv[optind + 1]),
+                   atoi(argv[optind + 2]));
   }
-  return f;
-}
 
-char *getDatasetName(char *fileName) {
-  const char *token = strrchr(fileName, '.');
-  if (!token || token == fileName) {
-    return strdup(fileName);
+  int userCount, permissionCount;
+  double loadStart = monotonicSeconds();
+  UPA *upa;
+  if (benchmark) {
+    upa = generateUPA(&bench, options.format);
+    userCount = upa->userCount;
+    permissionCount = upa->permissionCount;
+  } else {
+    char error[ERROR_SIZE];
+    upa = loadUPA(upaFile, options.format, options.threadCount, &userCount,
+                  &permissionCount, error);
+    if (upa == NULL) {
+      fprintf(stderr, "%s\n", error);
+      free(constraints);
+      return 1;
+    }
   }
+  double loadSeconds = monotonicSeconds() - loadStart;
 
-  size_t length = token - fileName;
+  // With -c the UPA is only converted to a snapshot for later runs.
+  if (options.snapshotFile != NULL) {
+    writeSnapshot(upa, options.snapshotFile);
+    freeUPA(upa);
+    free(constraints);
+    return 0;
+  }
 
-  char *datasetName = (char *)malloc(length + 1);
-  if (datasetName) {
-    strncpy(datasetName, fileName, length);
-    datasetName[length] = '\0';
+  char *dataset = getDatasetName(upaFile);
+
+  Reduction *reduction = NULL;
+  if (options.collapse) {
+    reduction = reduceUPA(upa, options.format);
+    LOG(LOG_INFO, "Collapsed to %d users and %d permissions\n",
+        reduction->upa->userCount, reduction->upa->permissionCount);
+  }
+
+  // With -u the roles of the previous run on this dataset are updated for the
+  // edges added and removed since, instead of being mined from scratch.
+  PriorRoles *prior = NULL;
+  if (options.deltaFile != NULL) {
+    prior = loadPriorRoles(upa, dataset, &options);
+    prior->mrcUser = priorMrcUser;
+    prior->mrcPerm = priorMrcPerm;
+    LOG(LOG_INFO, "Kept %d roles, dropped %d, %d users affected\n",
+        prior->kept->count, prior->dropped, prior->affectedCount);
+  }
+
+  // A benchmark measures mining alone and keeps no UA/PA files.
+  if (benchmark) {
+    options.saveRoles = 0;
+    if (constraintCount == 0) {
+      parseConstraints(BENCH_CONSTRAINTS, &constraints, &constraintCount);
+    }
+  }
+
+  if (constraintCount == 0) {
+    int mrcUser, mrcPermission;
+
+    printf("Enter the value of the role-usage cardinality constraint: ");
+    scanf("%d", &mrcUser);
+
+    printf("Enter the value of the permission-distribution cardinality "
+           "constraint: ");
+    scanf("%d", &mrcPermission);
+
+    addConstraints(&constraints, &constraintCount, mrcUser, mrcPermission);
+  }
+
+  // The pairs of a sweep run side by side, so their progress lines would
+  // interleave without saying which pair they belong to.
+  if (constraintCount > 1) {
+    options.progressLevel = LOG_DEBUG;
+  }
+
+  RunStats *stats = (RunStats *)calloc(constraintCount, sizeof(RunStats));
+  char **unenforced = (char **)calloc(constraintCount, sizeof(char *));
+  Sweep sweep = {upa,         reduction,       prior,       userCount,
+                 permissionCount,     dataset,     &options,
+                 loadSeconds, constraints,     constraintCount,
+                 0,           stats,           unenforced};
+  WorkerPool *pool = createWorkerPool(
+      options.jobCount < constraintCount ? options.jobCount : constraintCount);
+  runOnPool(pool, runSweep, &sweep);
+  freeWorkerPool(pool);
+
+  if (reduction) {
+    freeReduction(reduction);
+  }
+  if (prior) {
+    freePriorRoles(prior);
+  }
+  freeUPA(upa);
+  free(dataset);
+
+  if (benchmark) {
+    printBenchReport(&bench, &sweep);
+  } else {
+    for (int c = 0; c < constraintCount; c++) {
+      if (constraintCount > 1) {
+        printf("mrcUser = %d, mrcPermission = %d: ", constraints[2 * c],
+               constraints[2 * c + 1]);
+      }
+      if (stats[c].roleCount != -1) {
+        printf("Number of roles = %d\n", stats[c].roleCount);
+      } else {
+        printf(constraintCount > 1
+                   ? "constraints cannot be enforced\n"
+                   : "The given set of constraints cannot be enforced\n");
+        fputs(unenforced[c], stdout);
+      }
+    }
+  }
+  for (int c = 0; c < constraintCount; c++) {
+    free(unenforced[c]);
+  }
+  free(unenforced);
+  free(stats);
+  free(constraints);
+
+  return 0;
+}
+#endif
+
+static FILE *openFile(char *fileName, char *mode) {
+  FILE *f = fopen(fileName, mode);
+  if (f == NULL) {
+    perror("Unable to open file: ");
+    exit(1);
+  }
+  return f;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+static char *getDatasetName(char *fileName) {
+  const char *token = strrchr(fileName, '.');
+  if (!token || token == fileName) {
+    return strdup(fileName);
+  }
+
+  size_t length = token - fileName;
+
+  char *datasetName = (char *)malloc(length + 1);
+  if (datasetName) {
+    strncpy(datasetName, fileName, length);
+    datasetName[length] = '\0';
+  }
+  return datasetName;
+}
+
+static OutputFile *openOutput(char *fileName, int compress) {
+  OutputFile *out = (OutputFile *)calloc(1, sizeof(OutputFile));
+  out->buffer = (char *)malloc(OUTPUT_BUFFER_SIZE);
+#ifdef HAVE_ZLIB
+  if (compress) {
+    out->gz = gzopen(fileName, "wb");
+    if (out->gz == NULL) {
+      perror("Unable to open file: ");
+      exit(1);
+    }
+    return out;
+  }
+#else
+  (void)compress;
+#endif
+  out->file = openFile(fileName, "wb");
+  return out;
+}
+
+static void flushOutput(OutputFile *out) {
+#ifdef HAVE_ZLIB
+  if (out->gz != NULL) {
+    if (out->length > 0 &&
+        gzwrite((gzFile)out->gz, out->buffer, out->length) == 0) {
+      perror("Unable to write file: ");
+      exit(1);
+    }
+    out->length = 0;
+    return;
+  }
+#endif
+  if (fwrite(out->buffer, 1, out->length, out->file) != out->length) {
+    perror("Unable to write file: ");
+    exit(1);
+  }
+  out->length = 0;
+}
+
+static void writeOutput(OutputFile *out, const void *data, size_t size) {
+  const char *bytes = (const char *)data;
+  while (size > 0) {
+    if (out->length == OUTPUT_BUFFER_SIZE) {
+      flushOutput(out);
+    }
+    size_t chunk = OUTPUT_BUFFER_SIZE - out->length;
+    if (chunk > size) {
+      chunk = size;
+    }
+    memcpy(out->buffer + out->length, bytes, chunk);
+    out->length += chunk;
+    bytes += chunk;
+    size -= chunk;
+  }
+}
+
+static void closeOutput(OutputFile *out) {
+  flushOutput(out);
+#ifdef HAVE_ZLIB
+  if (out->gz != NULL) {
+    gzclose((gzFile)out->gz);
+  }
+#endif
+  if (out->file != NULL) {
+    fclose(out->file);
+  }
+  free(out->buffer);
+  free(out);
+}
+
+// Writes a matrix given as sorted column lists per row (row r lists
+// indices[offsets[r]] .. indices[offsets[r + 1] - 1]) in the chosen output
+// format. Dense text rows are patched into a reusable line of "0 " cells.
+static void writeMatrixToFile(int rows, int cols, int *offsets, int *indices,
+                              char *fileName, Options *options) {
+  OutputFile *out = openOutput(fileName, options->compress);
+
+  if (options->output == BINARY_OUTPUT) {
+    int32_t header[3] = {OUTPUT_MAGIC, rows, cols};
+    writeOutput(out, header, sizeof(header));
+    uint64_t *row = (uint64_t *)calloc(WORDS(cols) + 1, sizeof(uint64_t));
+    for (int i = 0; i < rows; i++) {
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        SET_BIT(row, indices[k]);
+      }
+      writeOutput(out, row, WORDS(cols) * sizeof(uint64_t));
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        CLEAR_BIT(row, indices[k]);
+      }
+    }
+    free(row);
+    closeOutput(out);
+    return;
+  }
+
+  char line[64];
+  int length = sprintf(line, "%d\n%d\n", rows, cols);
+  writeOutput(out, line, length);
+
+  if (options->output == EDGE_OUTPUT) {
+    for (int i = 0; i < rows; i++) {
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        length = sprintf(line, "%d %d\n", i + 1, indices[k] + 1);
+        writeOutput(out, line, length);
+      }
+    }
+    closeOutput(out);
+    return;
+  }
+
+  char *cells = (char *)malloc(2 * (size_t)cols + 1);
+  for (int j = 0; j < cols; j++) {
+    cells[2 * j] = '0';
+    cells[2 * j + 1] = ' ';
+  }
+  cells[2 * (size_t)cols] = '\n';
+  for (int i = 0; i < rows; i++) {
+    for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+      cells[2 * (size_t)indices[k]] = '1';
+    }
+    writeOutput(out, cells, 2 * (size_t)cols + 1);
+    for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+      cells[2 * (size_t)indices[k]] = '0';
+    }
+  }
+  free(cells);
+
+  closeOutput(out);
+}
+
+// Same input as writeMatrixToFile, written transposed. The row lists are
+// regrouped by column first so the output is still streamed row by row.
+static void writeMatrixTransposeToFile(int rows, int cols, int *offsets,
+                                       int *indices, char *fileName,
+                                       Options *options) {
+  int *transposeOffsets = (int *)calloc(cols + 1, sizeof(int));
+  int *transposeIndices = (int *)malloc((offsets[rows] + 1) * sizeof(int));
+  for (int k = 0; k < offsets[rows]; k++) {
+    transposeOffsets[indices[k] + 1]++;
+  }
+  for (int j = 0; j < cols; j++) {
+    transposeOffsets[j + 1] += transposeOffsets[j];
+  }
+  int *next = (int *)malloc((cols + 1) * sizeof(int));
+  memcpy(next, transposeOffsets, cols * sizeof(int));
+  for (int i = 0; i < rows; i++) {
+    for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+      transposeIndices[next[indices[k]]++] = i;
+    }
+  }
+  free(next);
+
+  writeMatrixToFile(cols, rows, transposeOffsets, transposeIndices, fileName,
+                    options);
+
+  free(transposeOffsets);
+  free(transposeIndices);
+}
+
+// The name of the UA or PA file of dataset in the output format of options.
+static void roleFileName(char *fileName, char *dataset, const char *matrix,
+                         Options *options) {
+  const char *extensions[] = {".txt", "_edges.txt", ".bin"};
+  sprintf(fileName, "%s_%s%s%s", dataset, matrix, extensions[options->output],
+          options->compress ? ".gz" : "");
+}
+#endif
+
+// Reads a whole file into memory, decompressing it if compress is set. The
+// contents are followed by a NUL byte not counted in size.
+static char *readFileContents(char *fileName, int compress, size_t *size) {
+  size_t capacity = OUTPUT_BUFFER_SIZE, length = 0;
+  char *data = (char *)malloc(capacity + 1);
+#ifdef HAVE_ZLIB
+  if (compress) {
+    gzFile gz = gzopen(fileName, "rb");
+    if (gz == NULL) {
+      perror("Unable to open file: ");
+      exit(1);
+    }
+    int n;
+    while ((n = gzread(gz, data + length, capacity - length)) > 0) {
+      length += n;
+      if (length == capacity) {
+        capacity *= 2;
+        data = (char *)realloc(data, capacity + 1);
+      }
+    }
+    if (n < 0) {
+      fprintf(stderr, "%s: cannot decompress\n", fileName);
+      exit(1);
+    }
+    gzclose(gz);
+    data[length] = '\0';
+    *size = length;
+    return data;
+  }
+#else
+  (void)compress;
+#endif
+  FILE *file = openFile(fileName, "rb");
+  size_t n;
+  while ((n = fread(data + length, 1, capacity - length, file)) > 0) {
+    length += n;
+    if (length == capacity) {
+      capacity *= 2;
+      data = (char *)realloc(data, capacity + 1);
+    }
+  }
+  fclose(file);
+  data[length] = '\0';
+  *size = length;
+  return data;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// Reads back a matrix written by writeMatrixToFile in the output format of
+// options, as the sorted column indices of each row.
+static void readMatrixFile(char *fileName, Options *options, int *rows,
+                           int *cols, int **offsets, int **indices) {
+  size_t size;
+  char *data = readFileContents(fileName, options->compress, &size);
+  const char *p = data, *end = data + size;
+
+  if (options->output == BINARY_OUTPUT) {
+    const int32_t *header = (const int32_t *)data;
+    if (size < 3 * sizeof(int32_t) || header[0] != OUTPUT_MAGIC ||
+        header[1] < 0 || header[2] < 0 ||
+        size != 3 * sizeof(int32_t) + (size_t)header[1] * WORDS(header[2]) *
+                                          sizeof(uint64_t)) {
+      reportParseError(fileName, data, data, "not a matrix in binary output");
+    }
+    *rows = header[1];
+    *cols = header[2];
+    const uint64_t *bits = (const uint64_t *)(header + 3);
+    long count = 0;
+    for (size_t w = 0; w < (size_t)*rows * WORDS(*cols); w++) {
+      uint64_t x;
+      memcpy(&x, bits + w, sizeof(x));
+      count += __builtin_popcountll(x);
+    }
+    *offsets = (int *)malloc((*rows + 1) * sizeof(int));
+    *indices = (int *)malloc((count + 1) * sizeof(int));
+    (*offsets)[0] = 0;
+    for (int i = 0; i < *rows; i++) {
+      int k = (*offsets)[i];
+      for (int w = 0; w < WORDS(*cols); w++) {
+        uint64_t x;
+        memcpy(&x, bits + (size_t)i * WORDS(*cols) + w, sizeof(x));
+        for (; x; x &= x - 1) {
+          (*indices)[k++] = w * WORD_BITS + __builtin_ctzll(x);
+        }
+      }
+      (*offsets)[i + 1] = k;
+    }
+    free(data);
+    return;
+  }
+
+  long rowCount, colCount;
+  p = parseIndex(skipBlanks(p, end), end, &rowCount);
+  if (p != NULL) {
+    p = parseIndex(skipBlanks(p, end), end, &colCount);
+  }
+  if (p == NULL || rowCount > INT_MAX || colCount > INT_MAX) {
+    reportParseError(fileName, data, data, "expected the matrix dimensions");
+  }
+  *rows = rowCount;
+  *cols = colCount;
+  *offsets = (int *)calloc(rowCount + 1, sizeof(int));
+  int capacity = 1024, count = 0;
+  *indices = (int *)malloc(capacity * sizeof(int));
+
+  if (options->output == EDGE_OUTPUT) {
+    // Edges come row by row and sorted, as writeMatrixToFile emits them.
+    int last = 0;
+    long previous = -1;
+    while ((p = skipBlanks(p, end)) < end) {
+      const char *line = p;
+      long i, j;
+      p = parseIndex(p, end, &i);
+      if (p != NULL) {
+        p = parseIndex(skipBlanks(p, end), end, &j);
+      }
+      if (p == NULL || i < 1 || i > rowCount || j < 1 || j > colCount ||
+          (i - 1) * colCount + j - 1 <= previous) {
+        reportParseError(fileName, data, line, "expected the next edge");
+      }
+      previous = (i - 1) * colCount + j - 1;
+      while (last < i - 1) {
+        (*offsets)[++last] = count;
+      }
+      if (count == capacity) {
+        capacity *= 2;
+        *indices = (int *)realloc(*indices, capacity * sizeof(int));
+      }
+      (*indices)[count++] = j - 1;
+    }
+    while (last < rowCount) {
+      (*offsets)[++last] = count;
+    }
+  } else {
+    for (int i = 0; i < rowCount; i++) {
+      for (int j = 0; j < colCount; j++) {
+        p = skipBlanks(p, end);
+        if (p == end || (*p != '0' && *p != '1')) {
+          reportParseError(fileName, data, p, "expected 0 or 1");
+        }
+        if (*p++ == '1') {
+          if (count == capacity) {
+            capacity *= 2;
+            *indices = (int *)realloc(*indices, capacity * sizeof(int));
+          }
+          (*indices)[count++] = j;
+        }
+      }
+      (*offsets)[i + 1] = count;
+    }
+  }
+  free(data);
+}
+#endif
+
+// Returns NULL if there is not enough memory.
+static BitMatrix *allocateMatrix(int rows, int cols) {
+  BitMatrix *matrix = (BitMatrix *)malloc(sizeof(BitMatrix));
+  if (matrix == NULL) {
+    return NULL;
+  }
+  matrix->rows = rows;
+  matrix->cols = cols;
+  matrix->words = WORDS(cols);
+  matrix->bits =
+      (uint64_t *)calloc((size_t)rows * matrix->words, sizeof(uint64_t));
+  if (matrix->bits == NULL && rows > 0 && matrix->words > 0) {
+    free(matrix);
+    return NULL;
+  }
+  return matrix;
+}
+
+static BitMatrix *createMatrix(int rows, int cols) {
+  BitMatrix *matrix = allocateMatrix(rows, cols);
+  if (matrix == NULL) {
+    perror("Unable to allocate bit matrix");
+    exit(1);
+  }
+  return matrix;
+}
+
+static void freeMatrix(BitMatrix *matrix) {
+  free(matrix->bits);
+  free(matrix);
+}
+
+static BitMatrix *copyMatrix(BitMatrix *matrix) {
+  BitMatrix *copy = createMatrix(matrix->rows, matrix->cols);
+  memcpy(copy->bits, matrix->bits,
+         (size_t)matrix->rows * matrix->words * sizeof(uint64_t));
+  return copy;
+}
+
+// Returns NULL if there is not enough memory.
+static BitMatrix *transposeMatrix(BitMatrix *matrix) {
+  BitMatrix *transpose = allocateMatrix(matrix->cols, matrix->rows);
+  if (transpose == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < matrix->rows; i++) {
+    uint64_t *row = ROW(matrix, i);
+    for (int w = 0; w < matrix->words; w++) {
+      for (uint64_t x = row[w]; x; x &= x - 1) {
+        int j = w * WORD_BITS + __builtin_ctzll(x);
+        SET_BIT(ROW(transpose, j), i);
+      }
+    }
+  }
+  return transpose;
+}
+
+static SparseMatrix *createSparseMatrix(int rows, int cols, int edgeCount,
+                                        int *edgeRows, int *edgeCols) {
+  SparseMatrix *matrix = (SparseMatrix *)calloc(1, sizeof(SparseMatrix));
+  if (matrix == NULL) {
+    return NULL;
+  }
+  matrix->rows = rows;
+  matrix->cols = cols;
+  matrix->rowOffsets = (int *)calloc(rows + 1, sizeof(int));
+  matrix->colOffsets = (int *)calloc(cols + 1, sizeof(int));
+
+  // Counting sort by column, then a stable one by row, leaves every row
+  // sorted by column with duplicate edges next to each other.
+  int *next = (int *)calloc((rows > cols ? rows : cols) + 1, sizeof(int));
+  int *byColumn = (int *)malloc((edgeCount + 1) * sizeof(int));
+  int *sorted = (int *)malloc((edgeCount + 1) * sizeof(int));
+  if (matrix->rowOffsets == NULL || matrix->colOffsets == NULL ||
+      next == NULL || byColumn == NULL || sorted == NULL) {
+    free(next);
+    free(byColumn);
+    free(sorted);
+    freeSparseMatrix(matrix);
+    return NULL;
+  }
+  for (int e = 0; e < edgeCount; e++) {
+    next[edgeCols[e] + 1]++;
+  }
+  for (int j = 0; j < cols; j++) {
+    next[j + 1] += next[j];
+  }
+  for (int e = 0; e < edgeCount; e++) {
+    byColumn[next[edgeCols[e]]++] = e;
+  }
+
+  for (int e = 0; e < edgeCount; e++) {
+    matrix->rowOffsets[edgeRows[e] + 1]++;
+  }
+  for (int i = 0; i < rows; i++) {
+    matrix->rowOffsets[i + 1] += matrix->rowOffsets[i];
+  }
+  memcpy(next, matrix->rowOffsets, rows * sizeof(int));
+  for (int k = 0; k < edgeCount; k++) {
+    int e = byColumn[k];
+    sorted[next[edgeRows[e]]++] = edgeCols[e];
+  }
+  free(byColumn);
+
+  int edges = 0;
+  for (int i = 0; i < rows; i++) {
+    int start = matrix->rowOffsets[i], end = matrix->rowOffsets[i + 1];
+    matrix->rowOffsets[i] = edges;
+    for (int k = start; k < end; k++) {
+      if (k == start || sorted[k] != sorted[k - 1]) {
+        sorted[edges++] = sorted[k];
+      }
+    }
+  }
+  matrix->rowOffsets[rows] = edges;
+  matrix->edges = edges;
+  // Shrinking in place may fail too, leaving sorted as it was.
+  matrix->colIndices = (int *)realloc(sorted, (edges + 1) * sizeof(int));
+  if (matrix->colIndices == NULL) {
+    matrix->colIndices = sorted;
+  }
+
+  matrix->rowIndices = (int *)malloc((edges + 1) * sizeof(int));
+  matrix->csrPositions = (int *)malloc((edges + 1) * sizeof(int));
+  if (matrix->rowIndices == NULL || matrix->csrPositions == NULL) {
+    free(next);
+    freeSparseMatrix(matrix);
+    return NULL;
+  }
+  for (int k = 0; k < edges; k++) {
+    matrix->colOffsets[matrix->colIndices[k] + 1]++;
+  }
+  for (int j = 0; j < cols; j++) {
+    matrix->colOffsets[j + 1] += matrix->colOffsets[j];
+  }
+  memcpy(next, matrix->colOffsets, cols * sizeof(int));
+  for (int i = 0; i < rows; i++) {
+    for (int k = matrix->rowOffsets[i]; k < matrix->rowOffsets[i + 1]; k++) {
+      int position = next[matrix->colIndices[k]]++;
+      matrix->rowIndices[position] = i;
+      matrix->csrPositions[position] = k;
+    }
+  }
+  free(next);
+
+  return matrix;
+}
+
+static void freeSparseMatrix(SparseMatrix *matrix) {
+  free(matrix->rowOffsets);
+  free(matrix->colIndices);
+  free(matrix->colOffsets);
+  free(matrix->rowIndices);
+  free(matrix->csrPositions);
+  free(matrix);
+}
+
+// Reads a UPA file: the user and permission counts followed by one 1-based
+// "user permission" edge per line. The file is mapped and cut at line
+// boundaries into one chunk per thread, and the chunks are parsed in
+// parallel. Malformed lines and out-of-range indices are reported with
+// their line number. Snapshot files are recognised by their magic number and
+// used in the layout they were written in.
+static UPA *loadUPA(char *fileName, enum UPAFormat format, int threadCount,
+                    int *userCount, int *permissionCount, char *error) {
+  int fd = open(fileName, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    snprintf(error, ERROR_SIZE, "%s: %s", fileName, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return NULL;
+  }
+  size_t size = st.st_size;
+  const char *data = "";
+  if (size > 0) {
+    data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      snprintf(error, ERROR_SIZE, "%s: %s", fileName, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+  }
+  close(fd);
+  if (size >= sizeof(int32_t) && *(const int32_t *)data == SNAPSHOT_MAGIC) {
+    UPA *upa = mapSnapshot(fileName, (void *)data, size, error);
+    if (upa == NULL) {
+      munmap((void *)data, size);
+      return NULL;
+    }
+    *userCount = upa->userCount;
+    *permissionCount = upa->permissionCount;
+    return upa;
+  }
+  if (size > 0) {
+    madvise((void *)data, size, MADV_SEQUENTIAL);
+  }
+  const char *end = data + size;
+
+  long users, permissions;
+  const char *p = parseIndex(skipBlanks(data, end), end, &users);
+  if (p != NULL) {
+    p = parseIndex(skipBlanks(p, end), end, &permissions);
+  }
+  const char *problem = NULL;
+  if (p == NULL) {
+    problem = "expected the user and permission counts";
+  } else if (users < 1 || users > INT_MAX || permissions < 1 ||
+             permissions > INT_MAX) {
+    problem = "user and permission counts must be positive";
+  }
+  if (problem != NULL) {
+    describeParseError(error, fileName, data, data, problem);
+    if (size > 0) {
+      munmap((void *)data, size);
+    }
+    return NULL;
+  }
+  *userCount = users;
+  *permissionCount = permissions;
+
+  WorkerPool *pool = createWorkerPool(threadCount);
+  int chunkCount = pool->threadCount;
+  EdgeChunk *chunks = (EdgeChunk *)calloc(chunkCount, sizeof(EdgeChunk));
+  for (int c = 0; c < chunkCount; c++) {
+    const char *begin = c == 0 ? p : p + (end - p) * c / chunkCount;
+    if (c > 0) {
+      if (begin < chunks[c - 1].begin) {
+        begin = chunks[c - 1].begin;
+      }
+      while (begin < end && begin[-1] != '\n') {
+        begin++;
+      }
+      chunks[c - 1].end = begin;
+    }
+    chunks[c].begin = begin;
+    chunks[c].end = end;
+    chunks[c].userCount = *userCount;
+    chunks[c].permissionCount = *permissionCount;
+  }
+  runOnPool(pool, parseEdgeChunk, chunks);
+
+  // The first chunk with an error has the first bad line.
+  long edgeCount = 0;
+  const char *position = NULL;
+  for (int c = 0; c < chunkCount; c++) {
+    if (chunks[c].error != NULL && problem == NULL) {
+      position = chunks[c].error;
+      problem = chunks[c].problem;
+    }
+    edgeCount += chunks[c].count;
+  }
+  if (problem == NULL && edgeCount > INT_MAX) {
+    position = end;
+    problem = "too many edges";
+  }
+  if (problem != NULL) {
+    describeParseError(error, fileName, data, position, problem);
+    freeEdgeChunks(chunks, chunkCount);
+    freeWorkerPool(pool);
+    if (size > 0) {
+      munmap((void *)data, size);
+    }
+    return NULL;
+  }
+
+  if (format == AUTO) {
+    format = chooseFormat(edgeCount, *userCount, *permissionCount);
+  }
+
+  UPA *upa = (UPA *)calloc(1, sizeof(UPA));
+  if (upa != NULL) {
+    upa->userCount = *userCount;
+    upa->permissionCount = *permissionCount;
+  }
+
+  if (upa != NULL && format == SPARSE) {
+    int *edgeUsers = (int *)malloc((edgeCount + 1) * sizeof(int));
+    int *edgePermissions = (int *)malloc((edgeCount + 1) * sizeof(int));
+    if (edgeUsers != NULL && edgePermissions != NULL) {
+      long e = 0;
+      for (int c = 0; c < chunkCount; c++) {
+        memcpy(edgeUsers + e, chunks[c].users, chunks[c].count * sizeof(int));
+        memcpy(edgePermissions + e, chunks[c].permissions,
+               chunks[c].count * sizeof(int));
+        e += chunks[c].count;
+      }
+      upa->sparse = createSparseMatrix(*userCount, *permissionCount,
+                                       edgeCount, edgeUsers, edgePermissions);
+      upa->ownsSparse = 1;
+    }
+    free(edgeUsers);
+    free(edgePermissions);
+  } else if (upa != NULL) {
+    upa->matrix = allocateMatrix(*userCount, *permissionCount);
+    if (upa->matrix != NULL) {
+      for (int c = 0; c < chunkCount; c++) {
+        chunks[c].matrix = upa->matrix;
+      }
+      runOnPool(pool, scatterEdgeChunk, chunks);
+      upa->transpose = transposeMatrix(upa->matrix);
+    }
+  }
+  if (upa != NULL) {
+    upa = finishBuiltUPA(upa);
+  }
+  if (upa == NULL) {
+    snprintf(error, ERROR_SIZE, "%s: out of memory", fileName);
+  }
+
+  freeEdgeChunks(chunks, chunkCount);
+  freeWorkerPool(pool);
+  if (size > 0) {
+    munmap((void *)data, size);
+  }
+
+  return upa;
+}
+
+static void freeEdgeChunks(EdgeChunk *chunks, int count) {
+  for (int c = 0; c < count; c++) {
+    free(chunks[c].users);
+    free(chunks[c].permissions);
+  }
+  free(chunks);
+}
+
+// Parses the decimal number at p. Returns the position after it, or NULL if
+// there is none. Values beyond INT_MAX are reported as INT_MAX + 1.
+static const char *parseIndex(const char *p, const char *end, long *value) {
+  if (p >= end || *p < '0' || *p > '9') {
+    return NULL;
+  }
+  long number = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    number = number * 10 + (*p - '0');
+    if (number > INT_MAX) {
+      number = (long)INT_MAX + 1;
+    }
+    p++;
+  }
+  *value = number;
+  return p;
+}
+
+static const char *skipBlanks(const char *p, const char *end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+    p++;
+  }
+  return p;
+}
+
+static void parseEdgeChunk(void *arg, int worker, int workerCount) {
+  (void)workerCount;
+  EdgeChunk *chunk = (EdgeChunk *)arg + worker;
+  const char *p = chunk->begin, *end = chunk->end;
+
+  chunk->capacity = 1024;
+  chunk->users = (int *)malloc(chunk->capacity * sizeof(int));
+  chunk->permissions = (int *)malloc(chunk->capacity * sizeof(int));
+
+  while (p < end) {
+    const char *line = p;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    if (*p == '\n') {
+      p++;
+      continue;
+    }
+
+    long i, j;
+    p = parseIndex(p, end, &i);
+    while (p != NULL && p < end && (*p == ' ' || *p == '\t')) {
+      p++;
+    }
+    if (p != NULL) {
+      p = parseIndex(p, end, &j);
+    }
+    while (p != NULL && p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+      p++;
+    }
+    if (p == NULL || (p < end && *p != '\n')) {
+      chunk->error = line;
+      chunk->problem = "expected a user and a permission index";
+      return;
+    }
+    if (i < 1 || i > chunk->userCount || j < 1 || j > chunk->permissionCount) {
+      chunk->error = line;
+      chunk->problem = "index out of range";
+      return;
+    }
+
+    if (chunk->count == chunk->capacity) {
+      chunk->capacity *= 2;
+      chunk->users =
+          (int *)realloc(chunk->users, chunk->capacity * sizeof(int));
+      chunk->permissions =
+          (int *)realloc(chunk->permissions, chunk->capacity * sizeof(int));
+    }
+    chunk->users[chunk->count] = i - 1;
+    chunk->permissions[chunk->count] = j - 1;
+    chunk->count++;
+    p++;
+  }
+}
+
+// Sets the chunk's edges in the dense matrix. Chunks may share words, so the
+// bits are set atomically.
+static void scatterEdgeChunk(void *arg, int worker, int workerCount) {
+  (void)workerCount;
+  EdgeChunk *chunk = (EdgeChunk *)arg + worker;
+  for (int e = 0; e < chunk->count; e++) {
+    int j = chunk->permissions[e];
+    __atomic_fetch_or(ROW(chunk->matrix, chunk->users[e]) + j / WORD_BITS,
+                      (uint64_t)1 << (j % WORD_BITS), __ATOMIC_RELAXED);
+  }
+}
+
+// Writes "file:line: problem" to error for the line of data at position.
+static void describeParseError(char *error, char *fileName, const char *data,
+                               const char *position, const char *problem) {
+  long line = 1;
+  for (const char *p = data; p < position; p++) {
+    line += *p == '\n';
+  }
+  snprintf(error, ERROR_SIZE, "%s:%ld: %s", fileName, line, problem);
+}
+
+#ifndef FRAMEWORK_LIBRARY
+static void reportParseError(char *fileName, const char *data,
+                             const char *position, const char *problem) {
+  char error[ERROR_SIZE];
+  describeParseError(error, fileName, data, position, problem);
+  fprintf(stderr, "%s\n", error);
+  exit(1);
+}
+
+static void writeSnapshot(UPA *upa, char *fileName) {
+  OutputFile *out = openOutput(fileName, 0);
+
+  SnapshotHeader header = {SNAPSHOT_MAGIC,
+                           SNAPSHOT_VERSION,
+                           upa->sparse ? SPARSE : DENSE,
+                           upa->userCount,
+                           upa->permissionCount,
+                           upa->sparse ? upa->sparse->edges : countEdges(upa),
+                           {0, 0}};
+  writeSection(out, &header, sizeof(header));
+
+  if (upa->sparse) {
+    SparseMatrix *sparse = upa->sparse;
+    writeSection(out, sparse->rowOffsets, (sparse->rows + 1) * sizeof(int));
+    writeSection(out, sparse->colIndices, sparse->edges * sizeof(int));
+    writeSection(out, sparse->colOffsets, (sparse->cols + 1) * sizeof(int));
+    writeSection(out, sparse->rowIndices, sparse->edges * sizeof(int));
+    writeSection(out, sparse->csrPositions, sparse->edges * sizeof(int));
+  } else {
+    writeSection(out, upa->matrix->bits,
+                 (size_t)upa->matrix->rows * upa->matrix->words *
+                     sizeof(uint64_t));
+    writeSection(out, upa->transpose->bits,
+                 (size_t)upa->transpose->rows * upa->transpose->words *
+                     sizeof(uint64_t));
+  }
+
+  closeOutput(out);
+}
+
+static void writeSection(OutputFile *out, const void *data, size_t size) {
+  static const char padding[8];
+  writeOutput(out, data, size);
+  writeOutput(out, padding, (8 - size % 8) % 8);
+}
+#endif
+
+// Builds a UPA over a mapped snapshot without copying it. Every section is
+// checked first, so that a damaged file cannot send the miner out of bounds:
+// offsets, sorted indices in range and CSC positions that lead back to the
+// same edge for a sparse UPA, and clear padding bits and a matching
+// transpose for a dense one. Returns NULL, with the problem in error, if a
+// check fails.
+static UPA *mapSnapshot(char *fileName, void *data, size_t size, char *error) {
+  const char *cursor = (const char *)data, *end = cursor + size;
+  const SnapshotHeader *header = (const SnapshotHeader *)snapshotSection(
+      &cursor, end, sizeof(SnapshotHeader));
+  const char *problem = NULL;
+  if (header == NULL) {
+    problem = "truncated snapshot";
+  } else if (header->version != SNAPSHOT_VERSION) {
+    problem = "unsupported snapshot version";
+  } else if (header->userCount < 1 || header->permissionCount < 1 ||
+             header->edges < 0 ||
+             (header->format != DENSE && header->format != SPARSE)) {
+    problem = "corrupt snapshot header";
+  }
+  if (problem != NULL) {
+    snprintf(error, ERROR_SIZE, "%s: %s", fileName, problem);
+    return NULL;
+  }
+
+  UPA *upa = (UPA *)calloc(1, sizeof(UPA));
+  upa->userCount = header->userCount;
+  upa->permissionCount = header->permissionCount;
+  upa->mapping = data;
+  upa->mappingSize = size;
+
+  if (header->format == SPARSE) {
+    SparseMatrix *sparse = (SparseMatrix *)malloc(sizeof(SparseMatrix));
+    sparse->rows = header->userCount;
+    sparse->cols = header->permissionCount;
+    sparse->edges = header->edges;
+    size_t edgeBytes = (size_t)sparse->edges * sizeof(int);
+    sparse->rowOffsets = (int *)snapshotSection(
+        &cursor, end, (sparse->rows + 1) * sizeof(int));
+    sparse->colIndices = (int *)snapshotSection(&cursor, end, edgeBytes);
+    sparse->colOffsets = (int *)snapshotSection(
+        &cursor, end, (sparse->cols + 1) * sizeof(int));
+    sparse->rowIndices = (int *)snapshotSection(&cursor, end, edgeBytes);
+    sparse->csrPositions = (int *)snapshotSection(&cursor, end, edgeBytes);
+    if (sparse->csrPositions == NULL) {
+      problem = "truncated snapshot";
+    } else if (!checkSnapshotOffsets(sparse->rowOffsets, sparse->rows,
+                                     sparse->edges) ||
+               !checkSnapshotOffsets(sparse->colOffsets, sparse->cols,
+                                     sparse->edges)) {
+      problem = "corrupt snapshot offsets";
+    } else if (!checkSnapshotIndices(sparse->rowOffsets, sparse->colIndices,
+                                     sparse->rows, sparse->cols) ||
+               !checkSnapshotIndices(sparse->colOffsets, sparse->rowIndices,
+                                     sparse->cols, sparse->rows) ||
+               !checkSnapshotPositions(sparse)) {
+      problem = "corrupt snapshot indices";
+    }
+    if (problem != NULL) {
+      snprintf(error, ERROR_SIZE, "%s: %s", fileName, problem);
+      free(sparse);
+      free(upa);
+      return NULL;
+    }
+
+    upa->sparse = sparse;
+    upa->ownsSparse = 1;
+    initEdgeMask(upa);
+  } else {
+    upa->matrix = (BitMatrix *)malloc(sizeof(BitMatrix));
+    upa->matrix->rows = header->userCount;
+    upa->matrix->cols = header->permissionCount;
+    upa->matrix->words = WORDS(header->permissionCount);
+    upa->matrix->bits = (uint64_t *)snapshotSection(
+        &cursor, end,
+        (size_t)upa->matrix->rows * upa->matrix->words * sizeof(uint64_t));
+    upa->transpose = (BitMatrix *)malloc(sizeof(BitMatrix));
+    upa->transpose->rows = header->permissionCount;
+    upa->transpose->cols = header->userCount;
+    upa->transpose->words = WORDS(header->userCount);
+    upa->transpose->bits = (uint64_t *)snapshotSection(
+        &cursor, end,
+        (size_t)upa->transpose->rows * upa->transpose->words *
+            sizeof(uint64_t));
+    if (upa->transpose->bits == NULL) {
+      problem = "truncated snapshot";
+    } else if (!checkSnapshotBits(upa->matrix) ||
+               !checkSnapshotBits(upa->transpose) ||
+               !checkSnapshotTranspose(upa, header->edges)) {
+      problem = "corrupt snapshot matrix";
+    }
+    if (problem != NULL) {
+      snprintf(error, ERROR_SIZE, "%s: %s", fileName, problem);
+      free(upa->matrix);
+      free(upa->transpose);
+      free(upa);
+      return NULL;
+    }
+  }
+
+  return upa;
+}
+
+// Returns the section of size bytes at *cursor and moves past its padding.
+// Once a section runs past end, it and all later ones are NULL.
+static const void *snapshotSection(const char **cursor, const char *end,
+                                   size_t size) {
+  const char *section = *cursor;
+  if (section == NULL || (size_t)(end - section) < size) {
+    *cursor = NULL;
+    return NULL;
+  }
+  size_t padded = size + (8 - size % 8) % 8;
+  *cursor = (size_t)(end - section) < padded ? end : section + padded;
+  return section;
+}
+
+static int checkSnapshotOffsets(const int *offsets, int count, int edges) {
+  if (offsets[0] != 0 || offsets[count] != edges) {
+    return 0;
+  }
+  for (int i = 0; i < count; i++) {
+    if (offsets[i] > offsets[i + 1]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Every row of indices must be strictly increasing and below limit.
+static int checkSnapshotIndices(const int *offsets, const int *indices,
+                                int count, int limit) {
+  for (int i = 0; i < count; i++) {
+    int previous = -1;
+    for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+      if (indices[k] <= previous || indices[k] >= limit) {
+        return 0;
+      }
+      previous = indices[k];
+    }
+  }
+  return 1;
+}
+
+// CSC entry k of column j and row i must point at the CSR entry of (i, j).
+// With no edge repeated in the CSR rows, that makes csrPositions one to one.
+static int checkSnapshotPositions(SparseMatrix *sparse) {
+  for (int j = 0; j < sparse->cols; j++) {
+    for (int k = sparse->colOffsets[j]; k < sparse->colOffsets[j + 1]; k++) {
+      int i = sparse->rowIndices[k], p = sparse->csrPositions[k];
+      if (p < sparse->rowOffsets[i] || p >= sparse->rowOffsets[i + 1] ||
+          sparse->colIndices[p] != j) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+// The bits past cols in the last word of every row must be clear.
+static int checkSnapshotBits(BitMatrix *matrix) {
+  if (matrix->cols % WORD_BITS == 0) {
+    return 1;
+  }
+  uint64_t padding = ~0ULL << (matrix->cols % WORD_BITS);
+  for (int i = 0; i < matrix->rows; i++) {
+    if (ROW(matrix, i)[matrix->words - 1] & padding) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The transpose must hold the edges of the matrix and no others, and both
+// as many as the header says.
+static int checkSnapshotTranspose(UPA *upa, int edges) {
+  long count = 0;
+  for (int i = 0; i < upa->userCount; i++) {
+    uint64_t *row = ROW(upa->matrix, i);
+    for (int w = 0; w < upa->matrix->words; w++) {
+      for (uint64_t x = row[w]; x; x &= x - 1) {
+        int j = w * WORD_BITS + __builtin_ctzll(x);
+        if (!GET_BIT(ROW(upa->transpose, j), i)) {
+          return 0;
+        }
+        count++;
+      }
+    }
+  }
+  long transposed = 0;
+  long words = (long)upa->transpose->rows * upa->transpose->words;
+  for (long w = 0; w < words; w++) {
+    transposed += __builtin_popcountll(upa->transpose->bits[w]);
+  }
+  return count == edges && transposed == edges;
+}
+
+static enum UPAFormat chooseFormat(long edgeCount, int userCount,
+                                   int permissionCount) {
+  return edgeCount * SPARSE_DENSITY_RATIO < (long)userCount * permissionCount
+             ? SPARSE
+             : DENSE;
+}
+
+// Marks every edge of a sparse UPA as present. Returns 0 if there is not
+// enough memory.
+static int initEdgeMask(UPA *upa) {
+  int words = WORDS(upa->sparse->edges);
+  upa->edgeMask = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+  if (upa->edgeMask == NULL) {
+    return 0;
+  }
+  memset(upa->edgeMask, 0xff, words * sizeof(uint64_t));
+  if (upa->sparse->edges % WORD_BITS) {
+    upa->edgeMask[words - 1] =
+        ((uint64_t)1 << (upa->sparse->edges % WORD_BITS)) - 1;
+  }
+  return 1;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// Parses users:permissions:roles:rolesPerUser:permissionsPerRole[:seed].
+static int parseBenchSpec(char *spec, BenchSpec *bench) {
+  long values[6] = {0, 0, 0, 0, 0, 1};
+  char *position = spec;
+  for (int f = 0; f < 6; f++) {
+    char *end;
+    values[f] = strtol(position, &end, 10);
+    if (end == position || values[f] < (f == 5 ? 0 : 1) ||
+        values[f] > INT_MAX) {
+      return 0;
+    }
+    if (*end == '\0') {
+      if (f < 4) {
+        return 0;
+      }
+      break;
+    }
+    if (*end != ':' || f == 5) {
+      return 0;
+    }
+    position = end + 1;
+  }
+  bench->userCount = values[0];
+  bench->permissionCount = values[1];
+  bench->roleCount = values[2];
+  bench->rolesPerUser = values[3];
+  bench->permissionsPerRole = values[4];
+  bench->seed = values[5];
+  return bench->rolesPerUser <= bench->roleCount &&
+         bench->permissionsPerRole <= bench->permissionCount &&
+         (long)bench->userCount * bench->rolesPerUser *
+                 bench->permissionsPerRole <=
+             INT_MAX;
+}
+
+static UPA *generateUPA(BenchSpec *bench, enum UPAFormat format) {
+  uint64_t state = bench->seed;
+  int perRole = bench->permissionsPerRole;
+  int *rolePermissions =
+      (int *)malloc((long)bench->roleCount * perRole * sizeof(int));
+  for (long k = 0; k < (long)bench->roleCount * perRole; k++) {
+    rolePermissions[k] = nextRandom(&state) % bench->permissionCount;
+  }
+
+  // Edges a user gets through several roles repeat here; building the UPA
+  // drops the duplicates.
+  long edgeCount = (long)bench->userCount * bench->rolesPerUser * perRole;
+  int *edgeUsers = (int *)malloc((edgeCount + 1) * sizeof(int));
+  int *edgePermissions = (int *)malloc((edgeCount + 1) * sizeof(int));
+  long e = 0;
+  for (int i = 0; i < bench->userCount; i++) {
+    for (int k = 0; k < bench->rolesPerUser; k++) {
+      int r = nextRandom(&state) % bench->roleCount;
+      for (int p = 0; p < perRole; p++) {
+        edgeUsers[e] = i;
+        edgePermissions[e++] = rolePermissions[(long)r * perRole + p];
+      }
+    }
+  }
+  free(rolePermissions);
+
+  UPA *upa = buildUPA(bench->userCount, bench->permissionCount, edgeCount,
+                      edgeUsers, edgePermissions, format);
+  free(edgeUsers);
+  free(edgePermissions);
+  return upa;
+}
+#endif
+
+// Builds a UPA from an edge list in which edges may repeat. Returns NULL if
+// there is not enough memory.
+static UPA *buildUPA(int userCount, int permissionCount, long edgeCount,
+                     int *edgeUsers, int *edgePermissions,
+                     enum UPAFormat format) {
+  if (format == AUTO) {
+    format = chooseFormat(edgeCount, userCount, permissionCount);
+  }
+
+  UPA *upa = (UPA *)calloc(1, sizeof(UPA));
+  if (upa == NULL) {
+    return NULL;
+  }
+  upa->userCount = userCount;
+  upa->permissionCount = permissionCount;
+  if (format == SPARSE) {
+    upa->sparse = createSparseMatrix(userCount, permissionCount, edgeCount,
+                                     edgeUsers, edgePermissions);
+    upa->ownsSparse = 1;
+  } else {
+    upa->matrix = allocateMatrix(userCount, permissionCount);
+    if (upa->matrix != NULL) {
+      for (long e = 0; e < edgeCount; e++) {
+        SET_BIT(ROW(upa->matrix, edgeUsers[e]), edgePermissions[e]);
+      }
+      upa->transpose = transposeMatrix(upa->matrix);
+    }
+  }
+  return finishBuiltUPA(upa);
+}
+
+// Gives a sparse UPA whose matrix was built its edge mask. Returns upa, or
+// NULL after freeing it if any part of it could not be allocated.
+static UPA *finishBuiltUPA(UPA *upa) {
+  if (upa->sparse != NULL ? initEdgeMask(upa)
+                          : upa->matrix != NULL && upa->transpose != NULL) {
+    return upa;
+  }
+  if (upa->sparse != NULL) {
+    freeSparseMatrix(upa->sparse);
+  }
+  if (upa->matrix != NULL) {
+    freeMatrix(upa->matrix);
+  }
+  free(upa);
+  return NULL;
+}
+
+// Users with equal rows get the same roles, as do permissions with equal
+// columns, so mining needs only one of each. Rows are collapsed first; that
+// leaves equal columns equal and makes no other rows equal, so one pass over
+// each side is enough.
+static Reduction *reduceUPA(UPA *upa, enum UPAFormat format) {
+  int userCount = upa->userCount, permissionCount = upa->permissionCount;
+  long edgeCount = countEdges(upa);
+  int *offsets = (int *)malloc(
+      ((userCount > permissionCount ? userCount : permissionCount) + 1) *
+      sizeof(int));
+  int *elements = (int *)malloc((edgeCount + 1) * sizeof(int));
+
+  offsets[0] = 0;
+  for (int i = 0; i < userCount; i++) {
+    offsets[i + 1] = offsets[i] + getRowElements(upa, i, elements + offsets[i]);
+  }
+  int *userClass = (int *)malloc((userCount + 1) * sizeof(int));
+  int userClasses = groupEqualLists(userCount, offsets, elements, userClass);
+
+  // The rows of the first users of the classes, by class.
+  int *edgeUsers = (int *)malloc((edgeCount + 1) * sizeof(int));
+  int *edgePermissions = (int *)malloc((edgeCount + 1) * sizeof(int));
+  long e = 0;
+  for (int i = 0, c = 0; i < userCount; i++) {
+    if (userClass[i] == c) {
+      for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        edgeUsers[e] = c;
+        edgePermissions[e++] = elements[k];
+      }
+      c++;
+    }
+  }
+
+  // Their columns, each sorted since the edges are in class order.
+  memset(offsets, 0, (permissionCount + 1) * sizeof(int));
+  for (long k = 0; k < e; k++) {
+    offsets[edgePermissions[k] + 1]++;
+  }
+  for (int j = 0; j < permissionCount; j++) {
+    offsets[j + 1] += offsets[j];
+  }
+  int *next = (int *)malloc((permissionCount + 1) * sizeof(int));
+  memcpy(next, offsets, (permissionCount + 1) * sizeof(int));
+  for (long k = 0; k < e; k++) {
+    elements[next[edgePermissions[k]]++] = edgeUsers[k];
+  }
+  free(next);
+  int *permClass = (int *)malloc((permissionCount + 1) * sizeof(int));
+  int permClasses =
+      groupEqualLists(permissionCount, offsets, elements, permClass);
+
+  Reduction *reduction = (Reduction *)calloc(1, sizeof(Reduction));
+  listMembers(userCount, userClass, userClasses, &reduction->userIds,
+              &reduction->userWeights, &reduction->userMemberOffsets,
+              &reduction->userMembers);
+  listMembers(permissionCount, permClass, permClasses, &reduction->permIds,
+              &reduction->permWeights, &reduction->permMemberOffsets,
+              &reduction->permMembers);
+
+  // Only the edges to the first permission of each class remain.
+  long kept = 0;
+  for (long k = 0; k < e; k++) {
+    int c = permClass[edgePermissions[k]];
+    if (reduction->permIds[c] == edgePermissions[k]) {
+      edgeUsers[kept] = edgeUsers[k];
+      edgePermissions[kept++] = c;
+    }
+  }
+  reduction->upa = buildUPA(userClasses, permClasses, kept, edgeUsers,
+                            edgePermissions, format);
+
+  free(offsets);
+  free(elements);
+  free(edgeUsers);
+  free(edgePermissions);
+  free(userClass);
+  free(permClass);
+  return reduction;
+}
+
+// Numbers the distinct lists among lists 0 to count - 1, each sorted and
+// stored from elements[offsets[v]] to elements[offsets[v + 1]], in the order
+// of their first occurrence. Returns the number of distinct lists.
+static int groupEqualLists(int count, int *offsets, int *elements,
+                           int *classes) {
+  int capacity = 1;
+  while (capacity < 2 * count) {
+    capacity *= 2;
+  }
+  int *slots = (int *)malloc(capacity * sizeof(int));
+  memset(slots, 0xff, capacity * sizeof(int));
+
+  int classCount = 0;
+  for (int v = 0; v < count; v++) {
+    int length = offsets[v + 1] - offsets[v];
+    uint64_t hash = length;
+    for (int k = offsets[v]; k < offsets[v + 1]; k++) {
+      hash = mixHash(hash, elements[k]);
+    }
+    int slot = hash & (capacity - 1);
+    while (slots[slot] != -1) {
+      int u = slots[slot];
+      if (offsets[u + 1] - offsets[u] == length &&
+          memcmp(elements + offsets[u], elements + offsets[v],
+                 length * sizeof(int)) == 0) {
+        break;
+      }
+      slot = (slot + 1) & (capacity - 1);
+    }
+    if (slots[slot] == -1) {
+      slots[slot] = v;
+      classes[v] = classCount++;
+    } else {
+      classes[v] = classes[slots[slot]];
+    }
+  }
+  free(slots);
+  return classCount;
+}
+
+// Lists the members of each class in order, from classes numbered in the
+// order of their first members.
+static void listMembers(int count, int *classes, int classCount, int **ids,
+                        int **weights, int **memberOffsets, int **members) {
+  *ids = (int *)malloc((classCount + 1) * sizeof(int));
+  *weights = (int *)calloc(classCount + 1, sizeof(int));
+  *memberOffsets = (int *)calloc(classCount + 1, sizeof(int));
+  *members = (int *)malloc((count + 1) * sizeof(int));
+  for (int v = 0; v < count; v++) {
+    if ((*weights)[classes[v]]++ == 0) {
+      (*ids)[classes[v]] = v;
+    }
+  }
+  for (int c = 0; c < classCount; c++) {
+    (*memberOffsets)[c + 1] = (*memberOffsets)[c] + (*weights)[c];
+  }
+  int *next = (int *)malloc((classCount + 1) * sizeof(int));
+  memcpy(next, *memberOffsets, (classCount + 1) * sizeof(int));
+  for (int v = 0; v < count; v++) {
+    (*members)[next[classes[v]]++] = v;
+  }
+  free(next);
+}
+
+static void freeReduction(Reduction *reduction) {
+  freeUPA(reduction->upa);
+  free(reduction->userIds);
+  free(reduction->permIds);
+  free(reduction->userWeights);
+  free(reduction->permWeights);
+  free(reduction->userMemberOffsets);
+  free(reduction->userMembers);
+  free(reduction->permMemberOffsets);
+  free(reduction->permMembers);
+  free(reduction);
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// Steps a Weyl sequence and scrambles it with mixHash, as splitmix64 does.
+static uint64_t nextRandom(uint64_t *state) {
+  *state += 0x9e3779b97f4a7c15ULL;
+  return mixHash(0, *state);
+}
+#endif
+
+static UPA *copyUPA(UPA *upa) {
+  UPA *copy = (UPA *)calloc(1, sizeof(UPA));
+  *copy = *upa;
+  copy->mapping = NULL;
+  if (upa->sparse) {
+    int words = WORDS(upa->sparse->edges);
+    copy->edgeMask = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+    memcpy(copy->edgeMask, upa->edgeMask, words * sizeof(uint64_t));
+    copy->ownsSparse = 0;
+  } else {
+    copy->matrix = copyMatrix(upa->matrix);
+    copy->transpose = copyMatrix(upa->transpose);
+  }
+  return copy;
+}
+
+static void freeUPA(UPA *upa) {
+  if (upa->mapping != NULL) {
+    // Only the structs and the edge mask were allocated; the arrays belong to
+    // the mapping.
+    free(upa->sparse);
+    free(upa->matrix);
+    free(upa->transpose);
+    free(upa->edgeMask);
+    munmap(upa->mapping, upa->mappingSize);
+  } else if (upa->sparse) {
+    if (upa->ownsSparse) {
+      freeSparseMatrix(upa->sparse);
+    }
+    free(upa->edgeMask);
+  } else {
+    freeMatrix(upa->matrix);
+    freeMatrix(upa->transpose);
+  }
+  free(upa);
+}
+
+static int countEdges(UPA *upa) {
+  uint64_t *bits = upa->sparse ? upa->edgeMask : upa->matrix->bits;
+  long words = upa->sparse ? WORDS(upa->sparse->edges)
+                           : (long)upa->matrix->rows * upa->matrix->words;
+  int count = 0;
+  for (long w = 0; w < words; w++) {
+    count += __builtin_popcountll(bits[w]);
+  }
+  return count;
+}
+
+// Row and column cursors: cells k in [rowStart, rowEnd) visit every permission
+// of a dense row, or only the stored edges of a sparse one.
+static int rowStart(UPA *upa, int i) {
+  return upa->sparse ? upa->sparse->rowOffsets[i] : 0;
+}
+
+static int rowEnd(UPA *upa, int i) {
+  return upa->sparse ? upa->sparse->rowOffsets[i + 1] : upa->permissionCount;
+}
+
+static int cellColumn(UPA *upa, int k) {
+  return upa->sparse ? upa->sparse->colIndices[k] : k;
+}
+
+static int isRowCellSet(UPA *upa, int i, int k) {
+  return upa->sparse ? GET_BIT(upa->edgeMask, k)
+                     : GET_BIT(ROW(upa->matrix, i), k);
+}
+
+static int columnStart(UPA *upa, int j) {
+  return upa->sparse ? upa->sparse->colOffsets[j] : 0;
+}
+
+static int columnEnd(UPA *upa, int j) {
+  return upa->sparse ? upa->sparse->colOffsets[j + 1] : upa->userCount;
+}
+
+static int cellRow(UPA *upa, int k) {
+  return upa->sparse ? upa->sparse->rowIndices[k] : k;
+}
+
+static int isColumnCellSet(UPA *upa, int j, int k) {
+  return upa->sparse ? GET_BIT(upa->edgeMask, upa->sparse->csrPositions[k])
+                     : GET_BIT(ROW(upa->transpose, j), k);
+}
+
+static int getRowElements(UPA *upa, int i, int *elements) {
+  int count = 0;
+  if (upa->sparse) {
+    for (int k = upa->sparse->rowOffsets[i]; k < upa->sparse->rowOffsets[i + 1];
+         k++) {
+      if (GET_BIT(upa->edgeMask, k)) {
+        elements[count++] = upa->sparse->colIndices[k];
+      }
+    }
+  } else {
+    uint64_t *row = ROW(upa->matrix, i);
+    for (int w = 0; w < upa->matrix->words; w++) {
+      for (uint64_t x = row[w]; x; x &= x - 1) {
+        elements[count++] = w * WORD_BITS + __builtin_ctzll(x);
+      }
+    }
+  }
+  return count;
+}
+
+static int getColumnElements(UPA *upa, int j, int *elements) {
+  int count = 0;
+  if (upa->sparse) {
+    for (int k = upa->sparse->colOffsets[j]; k < upa->sparse->colOffsets[j + 1];
+         k++) {
+      if (GET_BIT(upa->edgeMask, upa->sparse->csrPositions[k])) {
+        elements[count++] = upa->sparse->rowIndices[k];
+      }
+    }
+  } else {
+    uint64_t *column = ROW(upa->transpose, j);
+    for (int w = 0; w < upa->transpose->words; w++) {
+      for (uint64_t x = column[w]; x; x &= x - 1) {
+        elements[count++] = w * WORD_BITS + __builtin_ctzll(x);
+      }
+    }
+  }
+  return count;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// Whether (i, j) is an edge of upa, covered or not.
+static int hasEdge(UPA *upa, int i, int j) {
+  if (!upa->sparse) {
+    return GET_BIT(ROW(upa->matrix, i), j);
+  }
+  int low = upa->sparse->rowOffsets[i], high = upa->sparse->rowOffsets[i + 1];
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (upa->sparse->colIndices[middle] < j) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low < upa->sparse->rowOffsets[i + 1] &&
+         upa->sparse->colIndices[low] == j;
+}
+#endif
+
+// Counts the elements of row i that are in filter, or all of them if filter is
+// NULL, each element weighing weights[j] unless weights is NULL.
+static int countRowElements(UPA *upa, int i, uint64_t *filter, int *weights) {
+  int count = 0;
+  if (upa->sparse) {
+    for (int k = upa->sparse->rowOffsets[i]; k < upa->sparse->rowOffsets[i + 1];
+         k++) {
+      int j = upa->sparse->colIndices[k];
+      if (GET_BIT(upa->edgeMask, k) && (filter == NULL || GET_BIT(filter, j))) {
+        count += weights ? weights[j] : 1;
+      }
+    }
+  } else {
+    uint64_t *row = ROW(upa->matrix, i);
+    for (int w = 0; w < upa->matrix->words; w++) {
+      uint64_t x = filter ? row[w] & filter[w] : row[w];
+      if (weights == NULL) {
+        count += __builtin_popcountll(x);
+        continue;
+      }
+      for (; x; x &= x - 1) {
+        count += weights[w * WORD_BITS + __builtin_ctzll(x)];
+      }
+    }
+  }
+  return count;
+}
+
+static int countColumnElements(UPA *upa, int j, uint64_t *filter,
+                               int *weights) {
+  int count = 0;
+  if (upa->sparse) {
+    for (int k = upa->sparse->colOffsets[j]; k < upa->sparse->colOffsets[j + 1];
+         k++) {
+      int i = upa->sparse->rowIndices[k];
+      if (GET_BIT(upa->edgeMask, upa->sparse->csrPositions[k]) &&
+          (filter == NULL || GET_BIT(filter, i))) {
+        count += weights ? weights[i] : 1;
+      }
+    }
+  } else {
+    uint64_t *column = ROW(upa->transpose, j);
+    for (int w = 0; w < upa->transpose->words; w++) {
+      uint64_t x = filter ? column[w] & filter[w] : column[w];
+      if (weights == NULL) {
+        count += __builtin_popcountll(x);
+        continue;
+      }
+      for (; x; x &= x - 1) {
+        count += weights[w * WORD_BITS + __builtin_ctzll(x)];
+      }
+    }
+  }
+  return count;
+}
+
+// Sparse counterparts of the isSubset/hasElement tests in formRoleProcedure,
+// all answered in one pass over row i: set is a subset of V[i], UC[i] meets
+// set, and UC[i] is a subset of set.
+static void classifySparseRow(UPA *V, UPA *UC, int i, uint64_t *set,
+                              int setSize, int *inV, int *meetsUC,
+                              int *ucWithinSet) {
+  SparseMatrix *sparse = V->sparse;
+  int held = 0, uncoveredInSet = 0, uncoveredOutsideSet = 0;
+  for (int k = sparse->rowOffsets[i]; k < sparse->rowOffsets[i + 1]; k++) {
+    int inSet = GET_BIT(set, sparse->colIndices[k]);
+    if (GET_BIT(V->edgeMask, k)) {
+      held += inSet;
+    }
+    if (GET_BIT(UC->edgeMask, k)) {
+      if (inSet) {
+        uncoveredInSet++;
+      } else {
+        uncoveredOutsideSet++;
+      }
+    }
+  }
+  *inV = held == setSize;
+  *meetsUC = uncoveredInSet > 0;
+  *ucWithinSet = uncoveredOutsideSet == 0;
+}
+
+static void classifySparseColumn(UPA *V, UPA *UC, int j, uint64_t *set,
+                                 int setSize, int *inV, int *meetsUC,
+                                 int *ucWithinSet) {
+  SparseMatrix *sparse = V->sparse;
+  int held = 0, uncoveredInSet = 0, uncoveredOutsideSet = 0;
+  for (int k = sparse->colOffsets[j]; k < sparse->colOffsets[j + 1]; k++) {
+    int inSet = GET_BIT(set, sparse->rowIndices[k]);
+    int position = sparse->csrPositions[k];
+    if (GET_BIT(V->edgeMask, position)) {
+      held += inSet;
+    }
+    if (GET_BIT(UC->edgeMask, position)) {
+      if (inSet) {
+        uncoveredInSet++;
+      } else {
+        uncoveredOutsideSet++;
+      }
+    }
+  }
+  *inV = held == setSize;
+  *meetsUC = uncoveredInSet > 0;
+  *ucWithinSet = uncoveredOutsideSet == 0;
+}
+
+// Set by selectSetKernels before any mining starts, read-only afterwards.
+static SetKernels setKernels = {"scalar", isSubsetScalar, hasElementScalar};
+
+static void selectSetKernels(void) {
+#ifdef HAVE_SIMD_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    setKernels = (SetKernels){"avx512", isSubsetAvx512, hasElementAvx512};
+  } else if (__builtin_cpu_supports("avx2")) {
+    setKernels = (SetKernels){"avx2", isSubsetAvx2, hasElementAvx2};
+  }
+#endif
+}
+
+// Sets of a few words are not worth a vector pass.
+static int isSubset(uint64_t *a, uint64_t *b, int words) {
+  return words < 4 ? isSubsetScalar(a, b, words)
+                   : setKernels.isSubset(a, b, words);
+}
+
+static int hasElement(uint64_t *a, uint64_t *b, int words) {
+  return words < 4 ? hasElementScalar(a, b, words)
+                   : setKernels.hasElement(a, b, words);
+}
+
+static int isSubsetScalar(uint64_t *a, uint64_t *b, int words) {
+  for (int i = 0; i < words; i++) {
+    if (a[i] & ~b[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int hasElementScalar(uint64_t *a, uint64_t *b, int words) {
+  for (int i = 0; i < words; i++) {
+    if (a[i] & b[i]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+#ifdef HAVE_SIMD_KERNELS
+// Rows of a BitMatrix are only word aligned, hence the unaligned loads.
+static __attribute__((target("avx2"))) int isSubsetAvx2(uint64_t *a,
+                                                        uint64_t *b,
+                                                        int words) {
+  int i = 0;
+  for (; i + 4 <= words; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    // testc is set when x & ~y is zero.
+    if (!_mm256_testc_si256(y, x)) {
+      return 0;
+    }
+  }
+  return isSubsetScalar(a + i, b + i, words - i);
+}
+
+static __attribute__((target("avx2"))) int hasElementAvx2(uint64_t *a,
+                                                          uint64_t *b,
+                                                          int words) {
+  int i = 0;
+  for (; i + 4 <= words; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+    if (!_mm256_testz_si256(x, y)) {
+      return 1;
+    }
+  }
+  return hasElementScalar(a + i, b + i, words - i);
+}
+
+// The tail of fewer than eight words is read through a mask, so nothing past
+// the end of the sets is touched.
+static __attribute__((target("avx512f"))) int isSubsetAvx512(uint64_t *a,
+                                                             uint64_t *b,
+                                                             int words) {
+  for (int i = 0; i < words; i += 8) {
+    __mmask8 mask = words - i >= 8 ? 0xff : (1u << (words - i)) - 1;
+    __m512i x = _mm512_maskz_loadu_epi64(mask, a + i);
+    __m512i y = _mm512_maskz_loadu_epi64(mask, b + i);
+    if (_mm512_test_epi64_mask(_mm512_andnot_si512(y, x),
+                               _mm512_andnot_si512(y, x))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static __attribute__((target("avx512f"))) int hasElementAvx512(uint64_t *a,
+                                                               uint64_t *b,
+                                                               int words) {
+  for (int i = 0; i < words; i += 8) {
+    __mmask8 mask = words - i >= 8 ? 0xff : (1u << (words - i)) - 1;
+    __m512i x = _mm512_maskz_loadu_epi64(mask, a + i);
+    __m512i y = _mm512_maskz_loadu_epi64(mask, b + i);
+    if (_mm512_test_epi64_mask(x, y)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+#endif
+
+#ifndef FRAMEWORK_LIBRARY
+static int testSetKernels(void) {
+  SetKernels kernels[4];
+  int count = 0;
+  kernels[count++] = (SetKernels){"dispatch", isSubset, hasElement};
+#ifdef HAVE_SIMD_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels[count++] = (SetKernels){"avx2", isSubsetAvx2, hasElementAvx2};
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    kernels[count++] =
+        (SetKernels){"avx512", isSubsetAvx512, hasElementAvx512};
+  }
+#endif
+
+  int mismatches = 0;
+  for (int k = 0; k < count; k++) {
+    uint64_t seed = 1;
+    int failed = testSetKernel(&kernels[k], &seed);
+    printf("Set kernel %s: %s\n", kernels[k].name,
+           failed ? "MISMATCH" : "ok");
+    mismatches += failed;
+  }
+  return mismatches;
+}
+
+// Every size gets sets where the answer turns on a single bit, placed in
+// any word, so the vector bodies, the masked or scalar tails and the short
+// sets all decide some cases. The sets are allocated to their exact size,
+// so a kernel reading past their end sees heap garbage, not zeroes.
+static int testSetKernel(SetKernels *kernels, uint64_t *seed) {
+  int mismatches = 0;
+  for (int words = 0; words <= SET_KERNEL_TEST_WORDS; words++) {
+    uint64_t *a = (uint64_t *)malloc(words * sizeof(uint64_t) + 1);
+    uint64_t *b = (uint64_t *)malloc(words * sizeof(uint64_t) + 1);
+    for (int round = 0; round < SET_KERNEL_TEST_ROUNDS; round++) {
+      // a within b, or disjoint from it, until one bit is flipped.
+      int disjoint = round % 2;
+      for (int w = 0; w < words; w++) {
+        b[w] = nextRandom(seed);
+        a[w] = nextRandom(seed) & (disjoint ? ~b[w] : b[w]);
+      }
+      if (words > 0 && round % 4 >= 2) {
+        uint64_t r = nextRandom(seed);
+        int w = r % words, bit = (r >> 32) % WORD_BITS;
+        SET_BIT(a + w, bit);
+        if (disjoint) {
+          SET_BIT(b + w, bit);
+        } else {
+          CLEAR_BIT(b + w, bit);
+        }
+      }
+      if (kernels->isSubset(a, b, words) != isSubsetScalar(a, b, words) ||
+          kernels->hasElement(a, b, words) != hasElementScalar(a, b, words)) {
+        if (mismatches++ == 0) {
+          fprintf(stderr, "Set kernel %s differs from scalar on %d words\n",
+                  kernels->name, words);
+        }
+      }
+    }
+    free(a);
+    free(b);
+  }
+  return mismatches;
+}
+#endif
+
+static WorkerPool *createWorkerPool(int threadCount) {
+  WorkerPool *pool = (WorkerPool *)malloc(sizeof(WorkerPool));
+  pool->threadCount = 1;
+  pool->workers = (PoolWorker *)malloc(threadCount * sizeof(PoolWorker));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->job = NULL;
+  pool->arg = NULL;
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->stopping = 0;
+
+  // If a thread cannot be started the pool simply runs with fewer workers.
+  for (int t = 1; t < threadCount; t++) {
+    pool->workers[t].pool = pool;
+    pool->workers[t].index = t;
+    if (pthread_create(&pool->workers[t].thread, NULL, poolWorker,
+                       &pool->workers[t]) != 0) {
+      break;
+    }
+    pool->threadCount++;
+  }
+  return pool;
+}
+
+static void freeWorkerPool(WorkerPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int t = 1; t < pool->threadCount; t++) {
+    pthread_join(pool->workers[t].thread, NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->done);
+  free(pool->workers);
+  free(pool);
+}
+
+static void *poolWorker(void *arg) {
+  PoolWorker *worker = (PoolWorker *)arg;
+  WorkerPool *pool = worker->pool;
+  int generation = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->generation == generation && !pool->stopping) {
+      pthread_cond_wait(&pool->start, &pool->lock);
+    }
+    if (pool->stopping) {
+      break;
+    }
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->job(pool->arg, worker->index, pool->threadCount);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static void runOnPool(WorkerPool *pool, void (*job)(void *, int, int),
+                      void *arg) {
+  if (pool->threadCount == 1) {
+    job(arg, 0, 1);
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->arg = arg;
+  pool->pending = pool->threadCount - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+
+  job(arg, 0, pool->threadCount);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static TournamentTree *createTournamentTree(int size) {
+  TournamentTree *tree = (TournamentTree *)malloc(sizeof(TournamentTree));
+  tree->size = size;
+  tree->leaves = 1;
+  while (tree->leaves < size) {
+    tree->leaves *= 2;
+  }
+  tree->keys = (int *)malloc((size + 1) * sizeof(int));
+  for (int i = 0; i < size; i++) {
+    tree->keys[i] = INT_MAX;
+  }
+  tree->winners = (int *)malloc(2 * tree->leaves * sizeof(int));
+  for (int i = 0; i < tree->leaves; i++) {
+    tree->winners[tree->leaves + i] = i < size ? i : -1;
+  }
+  rebuildTournamentTree(tree);
+  return tree;
+}
+
+static void freeTournamentTree(TournamentTree *tree) {
+  free(tree->keys);
+  free(tree->winners);
+  free(tree);
+}
+
+// a always comes from the left subtree, so it holds the lower index.
+static int playMatch(TournamentTree *tree, int a, int b) {
+  if (b == -1) {
+    return a;
+  }
+  if (a == -1) {
+    return b;
+  }
+  return tree->keys[b] < tree->keys[a] ? b : a;
+}
+
+static void rebuildTournamentTree(TournamentTree *tree) {
+  for (int n = tree->leaves - 1; n >= 1; n--) {
+    tree->winners[n] =
+        playMatch(tree, tree->winners[2 * n], tree->winners[2 * n + 1]);
+  }
+}
+
+static void updateTournamentTree(TournamentTree *tree, int i, int key) {
+  if (tree->keys[i] == key) {
+    return;
+  }
+  tree->keys[i] = key;
+  for (int n = (tree->leaves + i) / 2; n >= 1; n /= 2) {
+    tree->winners[n] =
+        playMatch(tree, tree->winners[2 * n], tree->winners[2 * n + 1]);
+  }
+}
+
+// Index with the smallest key, or -1 when every key is INT_MAX.
+static int tournamentWinner(TournamentTree *tree) {
+  int winner = tree->winners[1];
+  if (winner == -1 || tree->keys[winner] == INT_MAX) {
+    return -1;
+  }
+  return winner;
+}
+
+// The initial scores are independent per vertex, so they are computed on the
+// pool over disjoint ranges of users and permissions. The tournament trees
+// are then built from the finished keys, which gives the same winners, and
+// the same tie-breaking, for any number of threads.
+static DegreeIndex *createDegreeIndex(UPA *UC, int *userRoleCount,
+                                      int *permRoleCount, int mrcUser,
+                                      int mrcPerm, int *userWeights,
+                                      int *permWeights, WorkerPool *pool) {
+  int userCount = UC->userCount, permissionCount = UC->permissionCount;
+
+  DegreeIndex *degrees = (DegreeIndex *)malloc(sizeof(DegreeIndex));
+  degrees->userCount = userCount;
+  degrees->permissionCount = permissionCount;
+  degrees->mrcUser = mrcUser;
+  degrees->mrcPerm = mrcPerm;
+  degrees->userRoleCount = userRoleCount;
+  degrees->permRoleCount = permRoleCount;
+  degrees->userUncovered = (int *)calloc(userCount + 1, sizeof(int));
+  degrees->permUncovered = (int *)calloc(permissionCount + 1, sizeof(int));
+  degrees->userDegree = (int *)calloc(userCount + 1, sizeof(int));
+  degrees->permDegree = (int *)calloc(permissionCount + 1, sizeof(int));
+  degrees->userWeights = userWeights;
+  degrees->permWeights = permWeights;
+  degrees->elements = (int *)malloc(
+      ((userCount > permissionCount ? userCount : permissionCount) + 1) *
+      sizeof(int));
+
+  degrees->fewestUser = createTournamentTree(userCount);
+  degrees->mostUser = createTournamentTree(userCount);
+  degrees->fewestPerm = createTournamentTree(permissionCount);
+  degrees->mostPerm = createTournamentTree(permissionCount);
+
+  uint64_t *eligibleUsers =
+      (uint64_t *)calloc(WORDS(userCount) + 1, sizeof(uint64_t));
+  uint64_t *eligiblePerms =
+      (uint64_t *)calloc(WORDS(permissionCount) + 1, sizeof(uint64_t));
+  for (int i = 0; i < userCount; i++) {
+    if (userRoleCount[i] < mrcUser - 1) {
+      SET_BIT(eligibleUsers, i);
+    }
+  }
+  for (int j = 0; j < permissionCount; j++) {
+    if (permRoleCount[j] < mrcPerm - 1) {
+      SET_BIT(eligiblePerms, j);
+    }
+  }
+
+  ScoringJob job = {degrees, UC, eligibleUsers, eligiblePerms};
+  runOnPool(pool, scoreVertices, &job);
+  free(eligibleUsers);
+  free(eligiblePerms);
+
+  rebuildTournamentTree(degrees->fewestUser);
+  rebuildTournamentTree(degrees->mostUser);
+  rebuildTournamentTree(degrees->fewestPerm);
+  rebuildTournamentTree(degrees->mostPerm);
+
+  return degrees;
+}
+
+static void scoreVertices(void *arg, int worker, int workerCount) {
+  ScoringJob *job = (ScoringJob *)arg;
+  DegreeIndex *degrees = job->degrees;
+
+  int userBegin = (long)degrees->userCount * worker / workerCount;
+  int userEnd = (long)degrees->userCount * (worker + 1) / workerCount;
+  for (int i = userBegin; i < userEnd; i++) {
+    degrees->userUncovered[i] =
+        countRowElements(job->UC, i, NULL, degrees->permWeights);
+    degrees->userDegree[i] =
+        countRowElements(job->UC, i, job->eligiblePerms, degrees->permWeights);
+    degrees->fewestUser->keys[i] = fewestKey(degrees->userDegree[i]);
+    degrees->mostUser->keys[i] =
+        mostKey(degrees->userUncovered[i], degrees->userRoleCount[i],
+                degrees->mrcUser);
+  }
+
+  int permBegin = (long)degrees->permissionCount * worker / workerCount;
+  int permEnd = (long)degrees->permissionCount * (worker + 1) / workerCount;
+  for (int j = permBegin; j < permEnd; j++) {
+    degrees->permUncovered[j] =
+        countColumnElements(job->UC, j, NULL, degrees->userWeights);
+    degrees->permDegree[j] = countColumnElements(
+        job->UC, j, job->eligibleUsers, degrees->userWeights);
+    degrees->fewestPerm->keys[j] = fewestKey(degrees->permDegree[j]);
+    degrees->mostPerm->keys[j] =
+        mostKey(degrees->permUncovered[j], degrees->permRoleCount[j],
+                degrees->mrcPerm);
+  }
+}
+
+// Vertices without eligible uncovered edges never win the fewest trees.
+static int fewestKey(int degree) { return degree > 0 ? degree : INT_MAX; }
+
+// Only vertices that can still take a role compete in the most trees.
+static int mostKey(int uncovered, int roleCount, int mrc) {
+  return uncovered > 0 && roleCount < mrc - 1 ? -uncovered : INT_MAX;
+}
+
+static void freeDegreeIndex(DegreeIndex *degrees) {
+  free(degrees->userUncovered);
+  free(degrees->permUncovered);
+  free(degrees->userDegree);
+  free(degrees->permDegree);
+  free(degrees->elements);
+  freeTournamentTree(degrees->fewestUser);
+  freeTournamentTree(degrees->fewestPerm);
+  freeTournamentTree(degrees->mostUser);
+  freeTournamentTree(degrees->mostPerm);
+  free(degrees);
+}
+
+static void refreshUserDegree(DegreeIndex *degrees, int i) {
+  updateTournamentTree(degrees->fewestUser, i,
+                       fewestKey(degrees->userDegree[i]));
+  updateTournamentTree(degrees->mostUser, i,
+                       mostKey(degrees->userUncovered[i],
+                               degrees->userRoleCount[i], degrees->mrcUser));
+}
+
+static void refreshPermDegree(DegreeIndex *degrees, int j) {
+  updateTournamentTree(degrees->fewestPerm, j,
+                       fewestKey(degrees->permDegree[j]));
+  updateTournamentTree(degrees->mostPerm, j,
+                       mostKey(degrees->permUncovered[j],
+                               degrees->permRoleCount[j], degrees->mrcPerm));
+}
+
+// Called for every edge (i, j) that modifyUC removes from UC.
+static void coverEdge(DegreeIndex *degrees, int i, int j) {
+  int userWeight = degrees->userWeights ? degrees->userWeights[i] : 1;
+  int permWeight = degrees->permWeights ? degrees->permWeights[j] : 1;
+  degrees->userUncovered[i] -= permWeight;
+  degrees->permUncovered[j] -= userWeight;
+  if (degrees->permRoleCount[j] < degrees->mrcPerm - 1) {
+    degrees->userDegree[i] -= permWeight;
+  }
+  if (degrees->userRoleCount[i] < degrees->mrcUser - 1) {
+    degrees->permDegree[j] -= userWeight;
+  }
+  refreshUserDegree(degrees, i);
+  refreshPermDegree(degrees, j);
+}
+
+static void setUserRoleCount(DegreeIndex *degrees, UPA *UC, int i, int count) {
+  int wasEligible = degrees->userRoleCount[i] < degrees->mrcUser - 1;
+  int isEligible = count < degrees->mrcUser - 1;
+  degrees->userRoleCount[i] = count;
+
+  if (wasEligible != isEligible) {
+    int weight = degrees->userWeights ? degrees->userWeights[i] : 1;
+    int elements = getRowElements(UC, i, degrees->elements);
+    for (int k = 0; k < elements; k++) {
+      int j = degrees->elements[k];
+      degrees->permDegree[j] += isEligible ? weight : -weight;
+      refreshPermDegree(degrees, j);
+    }
+  }
+  refreshUserDegree(degrees, i);
+}
+
+static void setPermRoleCount(DegreeIndex *degrees, UPA *UC, int j, int count) {
+  int wasEligible = degrees->permRoleCount[j] < degrees->mrcPerm - 1;
+  int isEligible = count < degrees->mrcPerm - 1;
+  degrees->permRoleCount[j] = count;
+
+  if (wasEligible != isEligible) {
+    int weight = degrees->permWeights ? degrees->permWeights[j] : 1;
+    int elements = getColumnElements(UC, j, degrees->elements);
+    for (int k = 0; k < elements; k++) {
+      int i = degrees->elements[k];
+      degrees->userDegree[i] += isEligible ? weight : -weight;
+      refreshUserDegree(degrees, i);
+    }
+  }
+  refreshPermDegree(degrees, j);
+}
+
+static Vertex selectVertexWithHeuristic(DegreeIndex *degrees) {
+  int min = degrees->userCount + degrees->permissionCount;
+
+  Vertex v = {-1, PERMISSION};
+
+  int j = tournamentWinner(degrees->fewestPerm);
+  if (j != -1) {
+    min = degrees->permDegree[j];
+    v.index = j;
+    v.type = PERMISSION;
+  }
+
+  // Users win ties against permissions.
+  int i = tournamentWinner(degrees->fewestUser);
+  if (i != -1 && (v.index == -1 || degrees->userDegree[i] <= min)) {
+    min = degrees->userDegree[i];
+    v.index = i;
+    v.type = USER;
+  }
+
+  LOG(LOG_DEBUG, "Count: %d\n", min);
+
+  return v;
+}
+
+static Vertex selectVertexWithMaxUncoveredIncidentEdges(DegreeIndex *degrees) {
+  int max = 0;
+
+  Vertex v = {-1, USER};
+
+  int i = tournamentWinner(degrees->mostUser);
+  if (i != -1) {
+    max = degrees->userUncovered[i];
+    v.index = i;
+  }
+
+  int j = tournamentWinner(degrees->mostPerm);
+  if (j != -1 && degrees->permUncovered[j] > max) {
+    max = degrees->permUncovered[j];
+    v.index = j;
+    v.type = PERMISSION;
+  }
+
+  if (v.index != -1) {
+    LOG(LOG_DEBUG, "%s: %d chosen for count %d\n",
+        v.type == USER ? "User" : "Permission", v.index, max);
+  }
+  return v;
+}
+
+static void startEdgeCursor(EdgeCursor *cursor, UPA *UC, int rewind) {
+  cursor->user = 0;
+  cursor->cell = rowStart(UC, 0);
+  cursor->visits = 0;
+  cursor->rewind = rewind;
+  cursor->passEdges = rewind ? countEdges(UC) : 0;
+}
+
+// Moves the cursor to the next uncovered edge at or after it in a row that may
+// have an edge for the given phase, and returns 0 once there is none left.
+// Rows are skipped on the counts of the DegreeIndex and covered cells a word
+// at a time, so a phase only visits uncovered edges of candidate rows.
+static int nextPhaseEdge(EdgeCursor *cursor, UPA *UC, DegreeIndex *degrees,
+                         int phase) {
+  for (;;) {
+    for (; cursor->user < UC->userCount; cursor->user++) {
+      int i = cursor->user;
+      if (mayHavePhaseEdge(degrees, phase, i)) {
+        long k;
+        if (UC->sparse) {
+          k = nextSetBit(UC->edgeMask, cursor->cell, rowEnd(UC, i));
+        } else {
+          k = nextSetBit(ROW(UC->matrix, i), cursor->cell,
+                         UC->permissionCount);
+        }
+        if (k != -1) {
+          if (k != cursor->cell) {
+            cursor->cell = k;
+            cursor->visits = 0;
+          }
+          return 1;
+        }
+      }
+      cursor->cell = rowStart(UC, i + 1);
+      cursor->visits = 0;
+    }
+    int edges = cursor->rewind ? countEdges(UC) : 0;
+    if (edges == 0 || edges == cursor->passEdges) {
+      return 0;
+    }
+    startEdgeCursor(cursor, UC, 1);
+  }
+}
+
+// Returns the permission of the edge under the cursor and counts the visit.
+// An edge of a collapsed UPA is visited, while uncovered, once for each edge
+// it stands for, so that a phase gets as many tries as on the full UPA.
+static int visitCursorEdge(EdgeCursor *cursor, UPA *UC, DegreeIndex *degrees) {
+  int i = cursor->user;
+  int j = cellColumn(UC, cursor->cell);
+  long edges = (long)(degrees->userWeights ? degrees->userWeights[i] : 1) *
+               (degrees->permWeights ? degrees->permWeights[j] : 1);
+  if (++cursor->visits >= edges) {
+    cursor->cell++;
+    cursor->visits = 0;
+  }
+  return j;
+}
+
+// Phase 1 takes the uncovered edges (i, j) where i or j can still take a role
+// without reaching its limit, Phase 2 those where one of them is at mrc - 1.
+// For Phase 1 the test is exact; for Phase 2 it only rules out rows without
+// uncovered edges, since permission counts can still rise to mrc - 1.
+static int mayHavePhaseEdge(DegreeIndex *degrees, int phase, int i) {
+  if (phase == 1) {
+    return degrees->userDegree[i] > 0 ||
+           (degrees->userUncovered[i] > 0 &&
+            degrees->userRoleCount[i] < degrees->mrcUser - 1);
+  }
+  return degrees->userUncovered[i] > 0;
+}
+
+// Returns the first set bit in [from, end), or -1.
+static long nextSetBit(uint64_t *bits, long from, long end) {
+  if (from >= end) {
+    return -1;
+  }
+  long w = from / WORD_BITS;
+  uint64_t x = bits[w] & (~0ULL << (from % WORD_BITS));
+  while (!x) {
+    if (++w * WORD_BITS >= end) {
+      return -1;
+    }
+    x = bits[w];
+  }
+  long k = w * WORD_BITS + __builtin_ctzll(x);
+  return k < end ? k : -1;
+}
+
+static int hasUncoveredEdges(UPA *UC) { return countEdges(UC) > 0; }
+
+#ifndef FRAMEWORK_LIBRARY
+// Mines upa and writes the roles out. If the constraints cannot be met,
+// *unenforced lists what cannot be covered, for the caller to print.
+static int concurrentProcessingFramework(UPA *upa, int userCount,
+                                         int permissionCount, int mrcUser,
+                                         int mrcPerm, char *dataset,
+                                         Options *options, Reduction *reduction,
+                                         PriorRoles *prior, char **unenforced,
+                                         RunStats *stats) {
+  double start = monotonicSeconds();
+
+  RoleStore *roles = mineUPA(upa, mrcUser, mrcPerm, options, reduction, prior,
+                             unenforced, stats);
+
+  int roleCount = stats->roleCount;
+
+  double outputStart = monotonicSeconds();
+  if (roleCount != -1 && options->saveRoles) {
+    char uaFile[strlen(dataset) + 32], paFile[strlen(dataset) + 32];
+    roleFileName(uaFile, dataset, "UA", options);
+    roleFileName(paFile, dataset, "PA", options);
+
+    writeMatrixTransposeToFile(roleCount, userCount, roles->userOffsets,
+                               roles->users, uaFile, options);
+    writeMatrixToFile(roleCount, permissionCount, roles->permOffsets,
+                      roles->permissions, paFile, options);
+  }
+  stats->outputSeconds = monotonicSeconds() - outputStart;
+  freeRoleStore(roles);
+
+  stats->totalSeconds = monotonicSeconds() - start;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  stats->peakResidentKiB = usage.ru_maxrss;
+  if (options->report) {
+    char statsFile[strlen(dataset) + 32];
+    sprintf(statsFile, "%s_stats.json", dataset);
+    writeStatsReport(statsFile, dataset, userCount, permissionCount, mrcUser,
+                     mrcPerm, options, stats);
+  }
+
+  return roleCount;
+}
+#endif
+
+// Mines upa in the way options ask for and returns the roles, in the vertex
+// numbering of upa. stats->roleCount is -1 if the constraints cannot be met;
+// *unenforced is then the list of edges left, and empty otherwise.
+static RoleStore *mineUPA(UPA *upa, int mrcUser, int mrcPerm, Options *options,
+                          Reduction *reduction, PriorRoles *prior,
+                          char **unenforced, RunStats *stats) {
+  // A collapsed UPA is mined in its place, each collapsed vertex weighing as
+  // much as the vertices it stands for.
+  UPA *mined = reduction ? reduction->upa : upa;
+  int *userIds = reduction ? reduction->userIds : NULL;
+  int *permIds = reduction ? reduction->permIds : NULL;
+  int *userWeights = reduction ? reduction->userWeights : NULL;
+  int *permWeights = reduction ? reduction->permWeights : NULL;
+
+  // Roles mined for looser constraints may already give a vertex more roles
+  // than it may have now, so such an update is mined from scratch.
+  PriorRoles *seed = prior;
+  if (prior != NULL) {
+    if (prior->mrcUser != 0 &&
+        (prior->mrcUser != mrcUser || prior->mrcPerm != mrcPerm)) {
+      fprintf(stderr,
+              "Warning: the roles to update were mined for mrcUser = %d, "
+              "mrcPermission = %d\n",
+              prior->mrcUser, prior->mrcPerm);
+    }
+    if (!rolesFit(prior->kept, mrcUser, mrcPerm)) {
+      fprintf(stderr, "Warning: the kept roles exceed the constraints, "
+                      "mining from scratch\n");
+      seed = NULL;
+    }
+  }
+
+  size_t unenforcedSize = 0;
+  FILE *stream = open_memstream(unenforced, &unenforcedSize);
+  RoleStore *roles =
+      options->components
+          ? mineComponents(mined, mrcUser, mrcPerm, options, userIds, permIds,
+                           userWeights, permWeights, stream, stats)
+          : mineRoles(mined, mrcUser, mrcPerm, options, userIds, permIds,
+                      userWeights, permWeights, seed, stream, stats);
+  fclose(stream);
+  if (prior) {
+    // The kept roles hold on to role counts a fresh run could spend
+    // elsewhere, and users they leave at their limit can still be picked to
+    // form a role, so an update that cannot meet the constraints, or goes
+    // over them, is mined again from scratch.
+    if (seed != NULL && (stats->roleCount == -1 ||
+                         !rolesFit(roles, mrcUser, mrcPerm))) {
+      fprintf(stderr, "Warning: the update cannot meet the constraints, "
+                      "mining from scratch\n");
+      freeRoleStore(roles);
+      free(*unenforced);
+      double loadSeconds = stats->loadSeconds;
+      memset(stats, 0, sizeof(RunStats));
+      stats->loadSeconds = loadSeconds;
+      stream = open_memstream(unenforced, &unenforcedSize);
+      roles = mineRoles(upa, mrcUser, mrcPerm, options, NULL, NULL, NULL, NULL,
+                        NULL, stream, stats);
+      fclose(stream);
+      seed = NULL;
+    }
+    if (seed == NULL) {
+      stats->minedFromScratch = 1;
+    } else {
+      stats->keptRoles = prior->kept->count;
+    }
+    stats->droppedRoles = prior->dropped;
+    stats->affectedUsers = prior->affectedCount;
+  }
+  if (reduction) {
+    RoleStore *collapsed = roles;
+    roles = expandRoles(collapsed, reduction, upa->userCount,
+                        upa->permissionCount);
+    freeRoleStore(collapsed);
+    stats->collapsedUsers = mined->userCount;
+    stats->collapsedPermissions = mined->permissionCount;
+  }
+  return roles;
+}
+
+MiningContext *createMiningContext(Options *options) {
+  static pthread_once_t kernelsSelected = PTHREAD_ONCE_INIT;
+  pthread_once(&kernelsSelected, selectSetKernels);
+
+  Options defaults = DEFAULT_OPTIONS;
+  MiningContext *context = (MiningContext *)calloc(1, sizeof(MiningContext));
+  if (context == NULL) {
+    return NULL;
+  }
+  context->options = options ? *options : defaults;
+  context->options.deltaFile = NULL;
+  context->options.checkpointFile = NULL;
+  context->options.resume = 0;
+  return context;
+}
+
+int loadMiningContext(MiningContext *context, char *fileName) {
+  int userCount, permissionCount;
+  UPA *upa = loadUPA(fileName, context->options.format,
+                     context->options.threadCount, &userCount,
+                     &permissionCount, context->error);
+  if (upa == NULL) {
+    return -1;
+  }
+  setMiningContextUPA(context, upa);
+  return 0;
+}
+
+int setMiningContextEdges(MiningContext *context, int userCount,
+                          int permissionCount, int edgeCount, int *edgeUsers,
+                          int *edgePermissions) {
+  if (userCount < 1 || permissionCount < 1 || edgeCount < 0) {
+    snprintf(context->error, ERROR_SIZE,
+             "user and permission counts must be positive");
+    return -1;
+  }
+  for (int e = 0; e < edgeCount; e++) {
+    if (edgeUsers[e] < 0 || edgeUsers[e] >= userCount ||
+        edgePermissions[e] < 0 || edgePermissions[e] >= permissionCount) {
+      snprintf(context->error, ERROR_SIZE, "edge %d out of range", e);
+      return -1;
+    }
+  }
+  UPA *upa = buildUPA(userCount, permissionCount, edgeCount, edgeUsers,
+                      edgePermissions, context->options.format);
+  if (upa == NULL) {
+    snprintf(context->error, ERROR_SIZE, "out of memory");
+    return -1;
+  }
+  setMiningContextUPA(context, upa);
+  return 0;
+}
+
+// Takes over upa, collapsing it now if the options ask for that, so that
+// every run reuses the collapsed UPA.
+static void setMiningContextUPA(MiningContext *context, UPA *upa) {
+  releaseMiningContext(context);
+  context->upa = upa;
+  if (context->options.collapse) {
+    context->reduction = reduceUPA(upa, context->options.format);
+  }
+}
+
+int runMiningContext(MiningContext *context, int mrcUser, int mrcPermission) {
+  if (context->upa == NULL) {
+    snprintf(context->error, ERROR_SIZE, "no UPA loaded");
+    return -1;
+  }
+  if (context->roles != NULL) {
+    freeRoleStore(context->roles);
+  }
+  free(context->unenforced);
+  memset(&context->stats, 0, sizeof(RunStats));
+
+  double start = monotonicSeconds();
+  context->roles = mineUPA(context->upa, mrcUser, mrcPermission,
+                           &context->options, context->reduction, NULL,
+                           &context->unenforced, &context->stats);
+  context->stats.totalSeconds = monotonicSeconds() - start;
+  if (context->stats.roleCount == -1) {
+    snprintf(context->error, ERROR_SIZE,
+             "the given set of constraints cannot be enforced");
+  }
+  return context->stats.roleCount;
+}
+
+int getMiningRole(MiningContext *context, int r, const int **users,
+                  int *userCount, const int **permissions,
+                  int *permissionCount) {
+  RoleStore *roles = context->roles;
+  if (roles == NULL || context->stats.roleCount == -1 || r < 0 ||
+      r >= roles->count) {
+    snprintf(context->error, ERROR_SIZE, "no role %d", r);
+    return -1;
+  }
+  *users = roles->users + roles->userOffsets[r];
+  *userCount = roles->userOffsets[r + 1] - roles->userOffsets[r];
+  *permissions = roles->permissions + roles->permOffsets[r];
+  *permissionCount = roles->permOffsets[r + 1] - roles->permOffsets[r];
+  return 0;
+}
+
+const char *getMiningError(MiningContext *context) { return context->error; }
+
+const char *getMiningUnenforced(MiningContext *context) {
+  return context->unenforced != NULL ? context->unenforced : "";
+}
+
+void releaseMiningContext(MiningContext *context) {
+  if (context->roles != NULL) {
+    freeRoleStore(context->roles);
+  }
+  if (context->reduction != NULL) {
+    freeReduction(context->reduction);
+  }
+  if (context->upa != NULL) {
+    freeUPA(context->upa);
+  }
+  free(context->unenforced);
+  context->roles = NULL;
+  context->reduction = NULL;
+  context->upa = NULL;
+  context->unenforced = NULL;
+}
+
+void freeMiningContext(MiningContext *context) {
+  releaseMiningContext(context);
+  free(context);
+}
+
+#ifndef FRAMEWORK_LIBRARY
+static int runDaemon(char *socketPath, Options *options) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", socketPath);
+    return 1;
+  }
+  strcpy(address.sun_path, socketPath);
+
+  // The socket of an earlier daemon is replaced; any other file is kept.
+  struct stat st;
+  if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socketPath);
+  }
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 16) != 0) {
+    fprintf(stderr, "%s: %s\n", socketPath, strerror(errno));
+    return 1;
+  }
+  // A client that leaves before its answer is written must not end the
+  // daemon.
+  signal(SIGPIPE, SIG_IGN);
+  LOG(LOG_INFO, "Listening on %s\n", socketPath);
+  fflush(stdout);
+
+  DaemonCache *cache = NULL;
+  int stop = 0;
+  while (!stop) {
+    int client = accept(listener, NULL, NULL);
+    if (client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "%s: %s\n", socketPath, strerror(errno));
+      break;
+    }
+    stop = serveClient(client, &cache, options);
+  }
+  close(listener);
+  unlink(socketPath);
+
+  while (cache != NULL) {
+    DaemonCache *next = cache->next;
+    freeMiningContext(cache->context);
+    free(cache->fileName);
+    free(cache);
+    cache = next;
+  }
+  return stop ? 0 : 1;
+}
+
+// Answers the requests of one client. Returns 1 if it asked for a shutdown.
+static int serveClient(int client, DaemonCache **cache, Options *options) {
+  FILE *in = fdopen(client, "r");
+  FILE *out = fdopen(dup(client), "w");
+  char *line = NULL;
+  size_t capacity = 0;
+  int stop = 0;
+  while (!stop && getline(&line, &capacity, in) != -1) {
+    char command[16];
+    char *fileName = (char *)malloc(strlen(line) + 1);
+    int mrcUser, mrcPermission;
+    int fields = sscanf(line, "%15s %s %d %d", command, fileName, &mrcUser,
+                        &mrcPermission);
+    if (fields == 4 && strcmp(command, "mine") == 0) {
+      char error[ERROR_SIZE];
+      MiningContext *context = cachedContext(cache, fileName, options, error);
+      if (context == NULL) {
+        fprintf(out, "error %s\n", error);
+      } else {
+        LOG(LOG_INFO, "Mining %s for %d, %d\n", fileName, mrcUser,
+            mrcPermission);
+        answerMining(out, context, mrcUser, mrcPermission);
+      }
+    } else if (fields == 2 && strcmp(command, "forget") == 0) {
+      if (forgetContext(cache, fileName)) {
+        fprintf(out, "ok 0\n");
+      } else {
+        fprintf(out, "error %s is not loaded\n", fileName);
+      }
+    } else if (fields == 1 && strcmp(command, "shutdown") == 0) {
+      fprintf(out, "ok 0\n");
+      stop = 1;
+    } else {
+      fprintf(out, "error unknown request\n");
+    }
+    free(fileName);
+    fflush(out);
+    fflush(stdout);
+  }
+  free(line);
+  fclose(in);
+  fclose(out);
+  return stop;
+}
+
+// Returns the context holding fileName, loading it on first use.
+static MiningContext *cachedContext(DaemonCache **cache, char *fileName,
+                                    Options *options, char *error) {
+  for (DaemonCache *entry = *cache; entry != NULL; entry = entry->next) {
+    if (strcmp(entry->fileName, fileName) == 0) {
+      return entry->context;
+    }
+  }
+  MiningContext *context = createMiningContext(options);
+  if (context == NULL) {
+    snprintf(error, ERROR_SIZE, "out of memory");
+    return NULL;
+  }
+  if (loadMiningContext(context, fileName) != 0) {
+    strcpy(error, context->error);
+    freeMiningContext(context);
+    return NULL;
+  }
+  LOG(LOG_INFO, "Loaded %s\n", fileName);
+  DaemonCache *entry = (DaemonCache *)malloc(sizeof(DaemonCache));
+  char *name = strdup(fileName);
+  if (entry == NULL || name == NULL) {
+    snprintf(error, ERROR_SIZE, "out of memory");
+    free(entry);
+    free(name);
+    freeMiningContext(context);
+    return NULL;
+  }
+  entry->fileName = name;
+  entry->context = context;
+  entry->next = *cache;
+  *cache = entry;
+  return context;
+}
+
+static int forgetContext(DaemonCache **cache, char *fileName) {
+  for (DaemonCache **link = cache; *link != NULL; link = &(*link)->next) {
+    DaemonCache *entry = *link;
+    if (strcmp(entry->fileName, fileName) == 0) {
+      *link = entry->next;
+      freeMiningContext(entry->context);
+      free(entry->fileName);
+      free(entry);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void answerMining(FILE *out, MiningContext *context, int mrcUser,
+                         int mrcPermission) {
+  int roleCount = runMiningContext(context, mrcUser, mrcPermission);
+  if (roleCount == -1) {
+    int lines = 0;
+    for (const char *c = context->unenforced; *c; c++) {
+      lines += *c == '\n';
+    }
+    fprintf(out, "infeasible %d\n%s", lines, context->unenforced);
+    return;
+  }
+  fprintf(out, "ok %d\n", roleCount);
+  for (int r = 0; r < roleCount; r++) {
+    const int *users, *permissions;
+    int userCount, permissionCount;
+    getMiningRole(context, r, &users, &userCount, &permissions,
+                  &permissionCount);
+    for (int k = 0; k < userCount; k++) {
+      fprintf(out, "%d ", users[k] + 1);
+    }
+    fputc('|', out);
+    for (int k = 0; k < permissionCount; k++) {
+      fprintf(out, " %d", permissions[k] + 1);
+    }
+    fputc('\n', out);
+  }
+}
+#endif
+
+// Alogrithm 4
+// Returns the roles found; stats->roleCount is -1 if the constraints cannot be
+// met, in which case the edges left are listed to unenforced, their vertices
+// numbered through userIds and permIds unless those are NULL. Vertex weights,
+// if given, are those of a collapsed UPA. With prior, the run starts from the
+// roles kept from a previous one and mines only what they leave uncovered.
+static RoleStore *mineRoles(UPA *upa, int mrcUser, int mrcPerm,
+                            Options *options, int *userIds, int *permIds,
+                            int *userWeights, int *permWeights,
+                            PriorRoles *prior, FILE *unenforced,
+                            RunStats *stats) {
+  int userCount = upa->userCount;
+  int permissionCount = upa->permissionCount;
+  int depth = options->speculationDepth > 1 ? options->speculationDepth : 0;
+
+  // Everything role formation needs comes out of the arena.
+  ScratchArena *arena = createScratchArena(
+      arenaSize((userCount + 1) * sizeof(int)) +
+      arenaSize((permissionCount + 1) * sizeof(int)) +
+      (depth + 1) * roleDraftSize(userCount, permissionCount));
+  int *userRoleCount =
+      (int *)arenaAlloc(arena, (userCount + 1) * sizeof(int));
+  int *permRoleCount =
+      (int *)arenaAlloc(arena, (permissionCount + 1) * sizeof(int));
+  RoleDraft *draft = createRoleDraft(arena, userCount, permissionCount);
+
+  RoleStore *roles = createRoleStore(userCount, permissionCount);
+  WorkerPool *pool = createWorkerPool(options->threadCount);
+  UPA *UC = copyUPA(upa);
+  if (prior != NULL) {
+    seedPriorRoles(prior, UC, roles, userRoleCount, permRoleCount);
+  }
+
+  // An update has only a few edges to cover, spread over the UPA, so its
+  // walks start over while they still cover edges rather than stop at the
+  // end of the first.
+  EdgeCursor cursor;
+  startEdgeCursor(&cursor, UC, prior != NULL);
+  int phase = 1, loopCount = 0;
+  double phaseSeconds = 0;
+  stats->edges = countEdges(UC);
+  stats->minCoveredEdges = INT_MAX;
+
+  // Everything below the DegreeIndex follows from UC, the role counts, the
+  // roles and the cursor, so that is all a checkpoint keeps.
+  Checkpoint *checkpoint =
+      createCheckpoint(options, upa, mrcUser, mrcPerm, UC, userRoleCount,
+                       permRoleCount, roles, &cursor, stats);
+  if (checkpoint != NULL && options->resume) {
+    resumeCheckpoint(checkpoint, upa, &phase, &loopCount, &phaseSeconds);
+  }
+  DegreeIndex *degrees =
+      createDegreeIndex(UC, userRoleCount, permRoleCount, mrcUser, mrcPerm,
+                        userWeights, permWeights, pool);
+  // Phase 1 drafts the next roles ahead of time when asked to.
+  Speculation *speculation = NULL;
+  if (depth > 0) {
+    speculation = createSpeculation(arena, depth, UC, upa, mrcUser, mrcPerm,
+                                    userRoleCount, permRoleCount);
+  }
+
+  int remainingUncoveredEdges = countEdges(UC);
+
+  // Phase 1
+  // Each phase walks its edges once in row-major order, trying a role for
+  // every edge still eligible when the walk reaches it.
+  double phaseStart = monotonicSeconds() - phaseSeconds;
+  if (phase == 1) {
+    LOG(options->progressLevel, "Phase 1\n");
+  }
+  while (phase == 1 && remainingUncoveredEdges > 0 &&
+         nextPhaseEdge(&cursor, UC, degrees, 1)) {
+    int i = cursor.user;
+    int j = visitCursorEdge(&cursor, UC, degrees);
+    loopCount++;
+    if (loopCount % 1000 == 0) {
+      LOG(LOG_DEBUG, "Phase 1 Loop %d: Remaining uncovered edges: %d\n",
+          loopCount, remainingUncoveredEdges);
+    }
+    if (userRoleCount[i] < mrcUser - 1 || permRoleCount[j] < mrcPerm - 1) {
+      resetRoleDraft(draft);
+
+      Vertex vertex = selectVertexWithHeuristic(degrees);
+
+      // No vertex has an eligible edge left, so neither has the walk.
+      if (vertex.index == -1) {
+        LOG(LOG_DEBUG, "No vertex selected\n");
+        break;
+      }
+      stats->selections[0]++;
+
+      RoleDraft *role = NULL;
+      if (speculation != NULL) {
+        role = speculativeFormRole(speculation, vertex, degrees, roles, pool);
+      } else if (vertex.type == USER) {
+        role = formRoleProcedure(vertex.index, UC, upa, mrcUser, mrcPerm,
+                                 userRoleCount, permRoleCount, degrees, roles,
+                                 draft, pool);
+      } else if (vertex.type == PERMISSION) {
+        role = dualFormRoleProcedure(vertex.index, UC, upa, mrcPerm, mrcPerm,
+                                     userRoleCount, permRoleCount, degrees,
+                                     roles, draft, pool);
+      }
+      if (vertex.type == USER) {
+        stats->formRoleCalls++;
+      } else {
+        stats->dualFormRoleCalls++;
+      }
+      if (role != NULL) {
+        int covered = modifyUC(UC, role->touchedUsers, role->touchedUserCount,
+                               role->P, degrees);
+        countCoveredEdges(stats, covered);
+        remainingUncoveredEdges = remainingUncoveredEdges - covered;
+        if (checkpoint != NULL) {
+          checkpointRun(checkpoint, 1, loopCount, phaseStart);
+        }
+      }
+    }
+  }
+
+  if (phase == 1) {
+    stats->phaseSeconds[0] = monotonicSeconds() - phaseStart;
+    phase = 2;
+    loopCount = 0;
+    phaseStart = monotonicSeconds();
+    startEdgeCursor(&cursor, UC, prior != NULL);
+  }
+
+  // Phase 2
+  LOG(options->progressLevel, "Phase 2\n");
+  while (remainingUncoveredEdges > 0 &&
+         nextPhaseEdge(&cursor, UC, degrees, 2)) {
+    int i = cursor.user;
+    int j = visitCursorEdge(&cursor, UC, degrees);
+    loopCount++;
+    if (loopCount % 1000 == 0) {
+      LOG(LOG_DEBUG, "Phase 2 Loop %d: Remaining uncovered edges: %d\n",
+          loopCount, remainingUncoveredEdges);
+    }
+
+    if (userRoleCount[i] == mrcUser - 1 || permRoleCount[j] == mrcPerm - 1) {
+      resetRoleDraft(draft);
+
+      Vertex vertex = selectVertexWithMaxUncoveredIncidentEdges(degrees);
+      LOG(LOG_DEBUG, "Vertex: %d type %d\n", vertex.index, vertex.type);
+
+      if (vertex.index == -1) {
+        LOG(LOG_DEBUG, "No vertex selected\n");
+        break;
+      }
+      stats->selections[1]++;
+
+      // The uncovered edges of the vertex go into the draft up front.
+      RoleDraft *role = NULL;
+      if (vertex.type == USER) {
+        int condition = 1;
+        for (int l = rowStart(UC, vertex.index); l < rowEnd(UC, vertex.index);
+             l++) {
+          if (isRowCellSet(UC, vertex.index, l)) {
+            int p = cellColumn(UC, l);
+            addDraftMember(draft, 1, p, 0);
+            if (permRoleCount[p] > mrcPerm - 1) {
+              condition = 0;
+            }
+          }
+        }
+        if (condition) {
+          role = formRoleProcedure(vertex.index, UC, upa, mrcUser, mrcPerm,
+                                   userRoleCount, permRoleCount, degrees, roles,
+                                   draft, pool);
+          stats->formRoleCalls++;
+        }
+      } else if (vertex.type == PERMISSION) {
+        int condition = 1;
+        for (int l = columnStart(UC, vertex.index);
+             l < columnEnd(UC, vertex.index); l++) {
+          int uc = isColumnCellSet(UC, vertex.index, l);
+          LOG(LOG_TRACE, "%d\n", uc);
+          if (uc) {
+            int u = cellRow(UC, l);
+            addDraftMember(draft, 0, u, 0);
+            if (userRoleCount[u] > mrcUser - 1) {
+              condition = 0;
+            }
+          }
+        }
+        if (condition) {
+          role = dualFormRoleProcedure(vertex.index, UC, upa, mrcUser, mrcPerm,
+                                       userRoleCount, permRoleCount, degrees,
+                                       roles, draft, pool);
+          stats->dualFormRoleCalls++;
+        }
+      }
+
+      if (role != NULL) {
+        int covered = modifyUC(UC, role->touchedUsers, role->touchedUserCount,
+                               role->P, degrees);
+        countCoveredEdges(stats, covered);
+        remainingUncoveredEdges = remainingUncoveredEdges - covered;
+        if (checkpoint != NULL) {
+          checkpointRun(checkpoint, 2, loopCount, phaseStart);
+        }
+      }
+    }
+  }
+
+  stats->phaseSeconds[1] = monotonicSeconds() - phaseStart;
+
+  int roleCount = roles->count;
+
+  if (hasUncoveredEdges(UC)) {
+    roleCount = -1;
+    for (int i = 0; i < userCount; i++) {
+      for (int k = rowStart(UC, i); k < rowEnd(UC, i); k++) {
+        if (isRowCellSet(UC, i, k)) {
+          int j = cellColumn(UC, k);
+          if (userRoleCount[i] < mrcUser - 1) {
+            fprintf(unenforced, "User %d\n", userIds ? userIds[i] : i);
+          }
+          if (permRoleCount[j] < mrcPerm - 1) {
+            fprintf(unenforced, "Permission %d\n", permIds ? permIds[j] : j);
+          }
+        }
+      }
+    }
+  }
+
+  stats->uncoveredEdges = countEdges(UC);
+  stats->roleCount = roleCount;
+  stats->duplicateRoles = roles->duplicates;
+  stats->emptyRoles = roles->empty;
+  if (speculation != NULL) {
+    stats->speculationRounds = speculation->rounds;
+    stats->speculationHits = speculation->hits;
+    stats->speculationRedrafts = speculation->redrafts;
+  }
+
+  freeDegreeIndex(degrees);
+  if (speculation != NULL) {
+    freeSpeculation(speculation);
+  }
+  if (checkpoint != NULL) {
+    finishCheckpoint(checkpoint);
+  }
+  freeWorkerPool(pool);
+  freeUPA(UC);
+  freeScratchArena(arena);
+
+  return roles;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// Parses -i: a number of roles, or a number of seconds followed by "s".
+static int parseCheckpointInterval(char *spec, Options *options) {
+  char *end;
+  long every = strtol(spec, &end, 10);
+  if (end == spec || every < 1 || every > INT_MAX ||
+      (*end != '\0' && strcmp(end, "s") != 0)) {
+    return 0;
+  }
+  options->checkpointRoles = *end ? 0 : every;
+  options->checkpointSeconds = *end ? every : 0;
+  return 1;
+}
+#endif
+
+// Hashes the edges of upa in row-major order, so that a checkpoint is only
+// resumed on the UPA it was taken from.
+static uint64_t fingerprintUPA(UPA *upa) {
+  uint64_t hash = mixHash(upa->userCount, upa->permissionCount);
+  for (int i = 0; i < upa->userCount; i++) {
+    for (int k = rowStart(upa, i); k < rowEnd(upa, i); k++) {
+      if (isRowCellSet(upa, i, k)) {
+        hash = mixHash(hash, (uint64_t)i << 32 | cellColumn(upa, k));
+      }
+    }
+  }
+  return hash;
+}
+
+// Returns NULL unless options ask for checkpoints. The other arguments are
+// the state of the run, which checkpoints copy and resumes fill in.
+static Checkpoint *createCheckpoint(Options *options, UPA *upa, int mrcUser,
+                                    int mrcPerm, UPA *UC, int *userRoleCount,
+                                    int *permRoleCount, RoleStore *roles,
+                                    EdgeCursor *cursor, RunStats *stats) {
+  if (options->checkpointFile == NULL) {
+    return NULL;
+  }
+  Checkpoint *checkpoint = (Checkpoint *)calloc(1, sizeof(Checkpoint));
+  checkpoint->fileName = options->checkpointFile;
+  checkpoint->everyRoles = options->checkpointRoles;
+  checkpoint->everySeconds = options->checkpointSeconds;
+  checkpoint->nextRoles = roles->count + checkpoint->everyRoles;
+  checkpoint->nextTime = monotonicSeconds() + checkpoint->everySeconds;
+  checkpoint->fingerprint = fingerprintUPA(upa);
+  checkpoint->mrcUser = mrcUser;
+  checkpoint->mrcPerm = mrcPerm;
+  checkpoint->UC = UC;
+  checkpoint->userRoleCount = userRoleCount;
+  checkpoint->permRoleCount = permRoleCount;
+  checkpoint->roles = roles;
+  checkpoint->cursor = cursor;
+  checkpoint->stats = stats;
+  return checkpoint;
+}
+
+// Called at the end of a loop iteration that formed a role; takes a
+// checkpoint if one is due. The previous one is waited for first, so that
+// at most one is being written.
+static void checkpointRun(Checkpoint *checkpoint, int phase, int loopCount,
+                          double phaseStart) {
+  RoleStore *roles = checkpoint->roles;
+  double now = monotonicSeconds();
+  if (checkpoint->everyRoles ? roles->count < checkpoint->nextRoles
+                             : now < checkpoint->nextTime) {
+    return;
+  }
+  checkpoint->nextRoles = roles->count + checkpoint->everyRoles;
+  checkpoint->nextTime = now + checkpoint->everySeconds;
+  if (checkpoint->writing) {
+    pthread_join(checkpoint->writer, NULL);
+  }
+
+  UPA *UC = checkpoint->UC;
+  EdgeCursor *cursor = checkpoint->cursor;
+  long maskWords = UC->sparse ? WORDS(UC->sparse->edges)
+                              : (long)UC->matrix->rows * UC->matrix->words;
+  int roleUsers = roles->userOffsets[roles->count];
+  int rolePermissions = roles->permOffsets[roles->count];
+  CheckpointHeader header = {CHECKPOINT_MAGIC,
+                             CHECKPOINT_VERSION,
+                             UC->userCount,
+                             UC->permissionCount,
+                             checkpoint->mrcUser,
+                             checkpoint->mrcPerm,
+                             checkpoint->fingerprint,
+                             sizeof(RunStats),
+                             phase,
+                             loopCount,
+                             roles->count,
+                             roleUsers,
+                             rolePermissions,
+                             roles->duplicates,
+                             roles->empty,
+                             cursor->user,
+                             cursor->cell,
+                             cursor->visits,
+                             cursor->rewind,
+                             cursor->passEdges,
+                             maskWords,
+                             now - phaseStart};
+
+  // Up to 7 bytes of padding follow each of the 9 sections.
+  size_t size = sizeof(header) + sizeof(RunStats) +
+                maskWords * sizeof(uint64_t) +
+                ((size_t)UC->userCount + UC->permissionCount +
+                 2 * ((size_t)roles->count + 1) + roleUsers +
+                 rolePermissions) *
+                    sizeof(int) +
+                7 * 9;
+  if (size > checkpoint->capacity) {
+    checkpoint->buffer = (char *)realloc(checkpoint->buffer, size);
+    checkpoint->capacity = size;
+  }
+  char *out = checkpoint->buffer;
+  putSection(&out, &header, sizeof(header));
+  putSection(&out, checkpoint->stats, sizeof(RunStats));
+  putSection(&out, UC->sparse ? UC->edgeMask : UC->matrix->bits,
+             maskWords * sizeof(uint64_t));
+  putSection(&out, checkpoint->userRoleCount, UC->userCount * sizeof(int));
+  putSection(&out, checkpoint->permRoleCount,
+             UC->permissionCount * sizeof(int));
+  putSection(&out, roles->userOffsets, (roles->count + 1) * sizeof(int));
+  putSection(&out, roles->permOffsets, (roles->count + 1) * sizeof(int));
+  putSection(&out, roles->users, roleUsers * sizeof(int));
+  putSection(&out, roles->permissions, rolePermissions * sizeof(int));
+  checkpoint->length = out - checkpoint->buffer;
+
+  LOG(LOG_DEBUG, "Checkpoint at %d roles\n", roles->count);
+  checkpoint->writing = 1;
+  pthread_create(&checkpoint->writer, NULL, writeCheckpointFile, checkpoint);
+}
+
+static void putSection(char **cursor, const void *data, size_t size) {
+  size_t padding = (8 - size % 8) % 8;
+  memcpy(*cursor, data, size);
+  memset(*cursor + size, 0, padding);
+  *cursor += size + padding;
+}
+
+static void *writeCheckpointFile(void *arg) {
+  Checkpoint *checkpoint = (Checkpoint *)arg;
+  char temporary[strlen(checkpoint->fileName) + 8];
+  sprintf(temporary, "%s.tmp", checkpoint->fileName);
+
+  // The file is synced before the rename, so a crash leaves either the old
+  // checkpoint or the new one.
+  FILE *file = fopen(temporary, "wb");
+  int written = file != NULL &&
+                fwrite(checkpoint->buffer, 1, checkpoint->length, file) ==
+                    checkpoint->length &&
+                fflush(file) == 0 && fsync(fileno(file)) == 0;
+  if ((file != NULL && fclose(file) != 0) || !written ||
+      rename(temporary, checkpoint->fileName) != 0) {
+    fprintf(stderr, "%s: checkpoint not written: %s\n", temporary,
+            strerror(errno));
+    unlink(temporary);
+  }
+  return NULL;
+}
+
+// Fills the state of the run in from its checkpoint file, or exits if the
+// file cannot be resumed on upa with the constraints of the run.
+static void resumeCheckpoint(Checkpoint *checkpoint, UPA *upa, int *phase,
+                             int *loopCount, double *phaseSeconds) {
+  size_t size;
+  char *data = readFileContents(checkpoint->fileName, 0, &size);
+  const char *problem = restoreCheckpoint(checkpoint, upa, data, size, phase,
+                                          loopCount, phaseSeconds);
+  free(data);
+  if (problem != NULL) {
+    fprintf(stderr, "%s: %s\n", checkpoint->fileName, problem);
+    exit(1);
+  }
+  checkpoint->nextRoles = checkpoint->roles->count + checkpoint->everyRoles;
+  LOG(LOG_INFO, "Resumed from %s with %d roles in Phase %d\n",
+      checkpoint->fileName, checkpoint->roles->count, *phase);
+}
+
+// Returns NULL once the checkpoint in data is restored, or what is wrong with
+// it. Nothing is restored unless every check passes.
+static const char *restoreCheckpoint(Checkpoint *checkpoint, UPA *upa,
+                                     const char *data, size_t size, int *phase,
+                                     int *loopCount, double *phaseSeconds) {
+  UPA *UC = checkpoint->UC;
+  int userCount = UC->userCount, permissionCount = UC->permissionCount;
+  const char *cursor = data, *end = data + size;
+  const CheckpointHeader *header = (const CheckpointHeader *)snapshotSection(
+      &cursor, end, sizeof(CheckpointHeader));
+  if (header == NULL || header->magic != CHECKPOINT_MAGIC ||
+      header->version != CHECKPOINT_VERSION ||
+      header->statsSize != sizeof(RunStats)) {
+    return "not a checkpoint of this version";
+  }
+  if (header->userCount != userCount ||
+      header->permissionCount != permissionCount ||
+      header->fingerprint != checkpoint->fingerprint ||
+      header->mrcUser != checkpoint->mrcUser ||
+      header->mrcPerm != checkpoint->mrcPerm) {
+    return "checkpoint of another UPA or other constraints";
+  }
+
+  long maskWords = UC->sparse ? WORDS(UC->sparse->edges)
+                              : (long)UC->matrix->rows * UC->matrix->words;
+  int roleCount = header->roleCount;
+  if ((header->phase != 1 && header->phase != 2) || roleCount < 0 ||
+      header->roleUsers < 0 || header->rolePermissions < 0 ||
+      header->maskWords != maskWords) {
+    return "corrupt checkpoint";
+  }
+  const RunStats *stats = (const RunStats *)snapshotSection(
+      &cursor, end, sizeof(RunStats));
+  const uint64_t *mask = (const uint64_t *)snapshotSection(
+      &cursor, end, maskWords * sizeof(uint64_t));
+  const int *userRoleCount =
+      (const int *)snapshotSection(&cursor, end, userCount * sizeof(int));
+  const int *permRoleCount = (const int *)snapshotSection(
+      &cursor, end, permissionCount * sizeof(int));
+  const int *userOffsets = (const int *)snapshotSection(
+      &cursor, end, ((size_t)roleCount + 1) * sizeof(int));
+  const int *permOffsets = (const int *)snapshotSection(
+      &cursor, end, ((size_t)roleCount + 1) * sizeof(int));
+  const int *users = (const int *)snapshotSection(
+      &cursor, end, (size_t)header->roleUsers * sizeof(int));
+  const int *permissions = (const int *)snapshotSection(
+      &cursor, end, (size_t)header->rolePermissions * sizeof(int));
+  if (permissions == NULL) {
+    return "truncated checkpoint";
+  }
+
+  // UC only ever loses edges of the UPA, and the cursor stays in its rows.
+  uint64_t *upaMask = upa->sparse ? upa->edgeMask : upa->matrix->bits;
+  for (long w = 0; w < maskWords; w++) {
+    if (mask[w] & ~upaMask[w]) {
+      return "corrupt checkpoint";
+    }
+  }
+  int user = header->cursorUser;
+  if (user < 0 || user > userCount || header->cursorVisits < 0 ||
+      header->cursorCell < rowStart(UC, user) ||
+      header->cursorCell > (user < userCount ? rowEnd(UC, user)
+                                             : rowStart(UC, user))) {
+    return "corrupt checkpoint";
+  }
+  if (!checkSnapshotOffsets(userOffsets, roleCount, header->roleUsers) ||
+      !checkSnapshotOffsets(permOffsets, roleCount,
+                            header->rolePermissions)) {
+    return "corrupt checkpoint";
+  }
+  for (int k = 0; k < header->roleUsers; k++) {
+    if (users[k] < 0 || users[k] >= userCount) {
+      return "corrupt checkpoint";
+    }
+  }
+  for (int k = 0; k < header->rolePermissions; k++) {
+    if (permissions[k] < 0 || permissions[k] >= permissionCount) {
+      return "corrupt checkpoint";
+    }
+  }
+
+  if (UC->sparse) {
+    memcpy(UC->edgeMask, mask, maskWords * sizeof(uint64_t));
+  } else {
+    memcpy(UC->matrix->bits, mask, maskWords * sizeof(uint64_t));
+    freeMatrix(UC->transpose);
+    UC->transpose = transposeMatrix(UC->matrix);
+    if (UC->transpose == NULL) {
+      return "out of memory";
+    }
+  }
+  memcpy(checkpoint->userRoleCount, userRoleCount, userCount * sizeof(int));
+  memcpy(checkpoint->permRoleCount, permRoleCount,
+         permissionCount * sizeof(int));
+
+  RoleStore *roles = checkpoint->roles;
+  for (int r = 0; r < roleCount; r++) {
+    int *roleUsers = (int *)users + userOffsets[r];
+    int *rolePermissions = (int *)permissions + permOffsets[r];
+    int n = userOffsets[r + 1] - userOffsets[r];
+    int m = permOffsets[r + 1] - permOffsets[r];
+    addRole(roles, roleUsers, n, rolePermissions, m,
+            hashRole(roleUsers, n, rolePermissions, m));
+  }
+  roles->duplicates = header->duplicateRoles;
+  roles->empty = header->emptyRoles;
+
+  double loadSeconds = checkpoint->stats->loadSeconds;
+  *checkpoint->stats = *stats;
+  checkpoint->stats->loadSeconds = loadSeconds;
+
+  EdgeCursor *edgeCursor = checkpoint->cursor;
+  edgeCursor->user = user;
+  edgeCursor->cell = header->cursorCell;
+  edgeCursor->visits = header->cursorVisits;
+  edgeCursor->rewind = header->cursorRewind;
+  edgeCursor->passEdges = header->cursorPassEdges;
+  *phase = header->phase;
+  *loopCount = header->loopCount;
+  *phaseSeconds = header->phaseSeconds;
+  return NULL;
+}
+
+// The last checkpoint is left in place; resuming from it finishes the run
+// the same way again.
+static void finishCheckpoint(Checkpoint *checkpoint) {
+  if (checkpoint->writing) {
+    pthread_join(checkpoint->writer, NULL);
+  }
+  free(checkpoint->buffer);
+  free(checkpoint);
+}
+
+// No role spans two connected components, so each is mined on its own and
+// the roles are numbered component by component, in the order of their first
+// users. Components run on options->threadCount workers, each mined
+// single-threaded.
+static RoleStore *mineComponents(UPA *upa, int mrcUser, int mrcPerm,
+                                 Options *options, int *userIds, int *permIds,
+                                 int *userWeights, int *permWeights,
+                                 FILE *unenforced, RunStats *stats) {
+  int *userComponent = (int *)malloc((upa->userCount + 1) * sizeof(int));
+  int *permComponent = (int *)malloc((upa->permissionCount + 1) * sizeof(int));
+  int count = findComponents(upa, userComponent, permComponent);
+  LOG(options->progressLevel, "Components: %d\n", count);
+  if (count <= 1) {
+    free(userComponent);
+    free(permComponent);
+    RoleStore *roles =
+        mineRoles(upa, mrcUser, mrcPerm, options, userIds, permIds,
+                  userWeights, permWeights, NULL, unenforced, stats);
+    stats->components = count;
+    return roles;
+  }
+
+  Component *components = splitComponents(
+      upa, userComponent, permComponent, count, userWeights, permWeights,
+      options->format == AUTO ? AUTO : (upa->sparse ? SPARSE : DENSE));
+  free(userComponent);
+  free(permComponent);
+
+  // Largest first, so that the longest runs do not start last.
+  Component **order = (Component **)malloc(count * sizeof(Component *));
+  for (int c = 0; c < count; c++) {
+    order[c] = &components[c];
+  }
+  qsort(order, count, sizeof(Component *), compareComponents);
+
+  Options componentOptions = *options;
+  componentOptions.threadCount = 1;
+  ComponentJob job = {order,   count,   0,      mrcUser,
+                      mrcPerm, &componentOptions, userIds, permIds};
+  WorkerPool *pool = createWorkerPool(
+      options->threadCount < count ? options->threadCount : count);
+  runOnPool(pool, mineComponent, &job);
+  freeWorkerPool(pool);
+  free(order);
+
+  RoleStore *roles = createRoleStore(upa->userCount, upa->permissionCount);
+  int *users = (int *)malloc((upa->userCount + 1) * sizeof(int));
+  int *permissions = (int *)malloc((upa->permissionCount + 1) * sizeof(int));
+  stats->minCoveredEdges = INT_MAX;
+  int feasible = 1;
+  for (int c = 0; c < count; c++) {
+    Component *component = &components[c];
+    RoleStore *part = component->roles;
+    for (int r = 0; r < part->count; r++) {
+      int userCount = 0, permissionCount = 0;
+      for (int k = part->userOffsets[r]; k < part->userOffsets[r + 1]; k++) {
+        users[userCount++] = component->userIds[part->users[k]];
+      }
+      for (int k = part->permOffsets[r]; k < part->permOffsets[r + 1]; k++) {
+        permissions[permissionCount++] =
+            component->permIds[part->permissions[k]];
+      }
+      addRole(roles, users, userCount, permissions, permissionCount,
+              hashRole(users, userCount, permissions, permissionCount));
+    }
+    feasible &= component->stats.roleCount != -1;
+    mergeRunStats(stats, &component->stats);
+    fputs(component->unenforced, unenforced);
+
+    free(component->unenforced);
+    freeRoleStore(part);
+    freeUPA(component->upa);
+    free(component->userIds);
+    free(component->permIds);
+    free(component->userWeights);
+    free(component->permWeights);
+  }
+  stats->roleCount = feasible ? roles->count : -1;
+  stats->components = count;
+  free(users);
+  free(permissions);
+  free(components);
+  return roles;
+}
+
+// Labels the vertices of upa with their connected component by union-find over
+// its edges, components numbered in the order of their first users. Vertices
+// without edges get -1. Returns the number of components.
+static int findComponents(UPA *upa, int *userComponent, int *permComponent) {
+  int userCount = upa->userCount;
+  int *parent =
+      (int *)malloc(((long)userCount + upa->permissionCount) * sizeof(int));
+  int *size =
+      (int *)malloc(((long)userCount + upa->permissionCount) * sizeof(int));
+  for (int v = 0; v < userCount + upa->permissionCount; v++) {
+    parent[v] = v;
+    size[v] = 1;
+  }
+  for (int i = 0; i < userCount; i++) {
+    for (int k = rowStart(upa, i); k < rowEnd(upa, i); k++) {
+      if (isRowCellSet(upa, i, k)) {
+        int a = findRoot(parent, i);
+        int b = findRoot(parent, userCount + cellColumn(upa, k));
+        if (a != b) {
+          if (size[a] < size[b]) {
+            int t = a;
+            a = b;
+            b = t;
+          }
+          parent[b] = a;
+          size[a] += size[b];
+        }
+      }
+    }
+  }
+
+  // A vertex left alone in its set has no edges. Every other set holds a
+  // user, so numbering the sets of the users numbers them all.
+  int count = 0;
+  for (int i = 0; i < userCount; i++) {
+    int r = findRoot(parent, i);
+    if (size[r] == 1) {
+      userComponent[i] = -1;
+      continue;
+    }
+    if (size[r] > 0) {
+      size[r] = -1 - count++;
+    }
+    userComponent[i] = -1 - size[r];
+  }
+  for (int j = 0; j < upa->permissionCount; j++) {
+    int r = findRoot(parent, userCount + j);
+    permComponent[j] = size[r] == 1 ? -1 : -1 - size[r];
+  }
+  free(parent);
+  free(size);
+  return count;
+}
+
+// Finds the root of v, halving the path on the way.
+static int findRoot(int *parent, int v) {
+  while (parent[v] != v) {
+    parent[v] = parent[parent[v]];
+    v = parent[v];
+  }
+  return v;
+}
+
+// Copies each labelled component of upa into a UPA of its own.
+static Component *splitComponents(UPA *upa, int *userComponent,
+                                  int *permComponent, int count,
+                                  int *userWeights, int *permWeights,
+                                  enum UPAFormat format) {
+  Component *components = (Component *)calloc(count, sizeof(Component));
+  int *userTotals = (int *)calloc(count, sizeof(int));
+  int *permTotals = (int *)calloc(count, sizeof(int));
+  int *localUser = (int *)malloc((upa->userCount + 1) * sizeof(int));
+  int *localPerm = (int *)malloc((upa->permissionCount + 1) * sizeof(int));
+  for (int i = 0; i < upa->userCount; i++) {
+    int c = userComponent[i];
+    if (c != -1) {
+      localUser[i] = userTotals[c]++;
+      for (int k = rowStart(upa, i); k < rowEnd(upa, i); k++) {
+        components[c].edges += isRowCellSet(upa, i, k);
+      }
+    }
+  }
+  for (int j = 0; j < upa->permissionCount; j++) {
+    int c = permComponent[j];
+    if (c != -1) {
+      localPerm[j] = permTotals[c]++;
+    }
+  }
+
+  int **edgeUsers = (int **)malloc(count * sizeof(int *));
+  int **edgePermissions = (int **)malloc(count * sizeof(int *));
+  long *filled = (long *)calloc(count, sizeof(long));
+  for (int c = 0; c < count; c++) {
+    components[c].userIds = (int *)malloc((userTotals[c] + 1) * sizeof(int));
+    components[c].permIds = (int *)malloc((permTotals[c] + 1) * sizeof(int));
+    edgeUsers[c] = (int *)malloc((components[c].edges + 1) * sizeof(int));
+    edgePermissions[c] =
+        (int *)malloc((components[c].edges + 1) * sizeof(int));
+  }
+  for (int j = 0; j < upa->permissionCount; j++) {
+    if (permComponent[j] != -1) {
+      components[permComponent[j]].permIds[localPerm[j]] = j;
+    }
+  }
+  for (int i = 0; i < upa->userCount; i++) {
+    int c = userComponent[i];
+    if (c == -1) {
+      continue;
+    }
+    components[c].userIds[localUser[i]] = i;
+    for (int k = rowStart(upa, i); k < rowEnd(upa, i); k++) {
+      if (isRowCellSet(upa, i, k)) {
+        edgeUsers[c][filled[c]] = localUser[i];
+        edgePermissions[c][filled[c]++] = localPerm[cellColumn(upa, k)];
+      }
+    }
+  }
+
+  for (int c = 0; c < count; c++) {
+    components[c].upa =
+        buildUPA(userTotals[c], permTotals[c], components[c].edges,
+                 edgeUsers[c], edgePermissions[c], format);
+    // Weights follow the vertices into their components.
+    if (userWeights) {
+      components[c].userWeights =
+          (int *)malloc((userTotals[c] + 1) * sizeof(int));
+      for (int l = 0; l < userTotals[c]; l++) {
+        components[c].userWeights[l] = userWeights[components[c].userIds[l]];
+      }
+    }
+    if (permWeights) {
+      components[c].permWeights =
+          (int *)malloc((permTotals[c] + 1) * sizeof(int));
+      for (int l = 0; l < permTotals[c]; l++) {
+        components[c].permWeights[l] = permWeights[components[c].permIds[l]];
+      }
+    }
+    free(edgeUsers[c]);
+    free(edgePermissions[c]);
+  }
+  free(edgeUsers);
+  free(edgePermissions);
+  free(filled);
+  free(userTotals);
+  free(permTotals);
+  free(localUser);
+  free(localPerm);
+  return components;
+}
+
+// Orders components by decreasing edge count, then by their first users.
+static int compareComponents(const void *a, const void *b) {
+  const Component *x = *(Component *const *)a;
+  const Component *y = *(Component *const *)b;
+  if (x->edges != y->edges) {
+    return x->edges > y->edges ? -1 : 1;
+  }
+  return x->userIds[0] - y->userIds[0];
+}
+
+static void mineComponent(void *arg, int worker, int workerCount) {
+  (void)worker;
+  (void)workerCount;
+  ComponentJob *job = (ComponentJob *)arg;
+  int c;
+  while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+         job->count) {
+    Component *component = job->order[c];
+    UPA *upa = component->upa;
+
+    // Uncovered vertices are reported under the ids the whole UPA has.
+    int *userIds = component->userIds, *permIds = component->permIds;
+    if (job->userIds) {
+      userIds = (int *)malloc((upa->userCount + 1) * sizeof(int));
+      for (int l = 0; l < upa->userCount; l++) {
+        userIds[l] = job->userIds[component->userIds[l]];
+      }
+    }
+    if (job->permIds) {
+      permIds = (int *)malloc((upa->permissionCount + 1) * sizeof(int));
+      for (int l = 0; l < upa->permissionCount; l++) {
+        permIds[l] = job->permIds[component->permIds[l]];
+      }
+    }
+
+    FILE *unenforced =
+        open_memstream(&component->unenforced, &component->unenforcedSize);
+    component->roles =
+        mineRoles(upa, job->mrcUser, job->mrcPermission, job->options, userIds,
+                  permIds, component->userWeights, component->permWeights,
+                  NULL, unenforced, &component->stats);
+    fclose(unenforced);
+    if (job->userIds) {
+      free(userIds);
+    }
+    if (job->permIds) {
+      free(permIds);
+    }
+  }
+}
+
+// Adds the counters of one component's run to those of the whole run. Times
+// add up too, as worker time rather than elapsed time.
+static void mergeRunStats(RunStats *total, RunStats *part) {
+  total->phaseSeconds[0] += part->phaseSeconds[0];
+  total->phaseSeconds[1] += part->phaseSeconds[1];
+  total->edges += part->edges;
+  total->uncoveredEdges += part->uncoveredEdges;
+  total->selections[0] += part->selections[0];
+  total->selections[1] += part->selections[1];
+  total->formRoleCalls += part->formRoleCalls;
+  total->dualFormRoleCalls += part->dualFormRoleCalls;
+  total->duplicateRoles += part->duplicateRoles;
+  total->emptyRoles += part->emptyRoles;
+  if (part->minCoveredEdges < total->minCoveredEdges) {
+    total->minCoveredEdges = part->minCoveredEdges;
+  }
+  if (part->maxCoveredEdges > total->maxCoveredEdges) {
+    total->maxCoveredEdges = part->maxCoveredEdges;
+  }
+  total->coveredEdges += part->coveredEdges;
+  total->speculationRounds += part->speculationRounds;
+  total->speculationHits += part->speculationHits;
+  total->speculationRedrafts += part->speculationRedrafts;
+}
+
+static double monotonicSeconds(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static void countCoveredEdges(RunStats *stats, int covered) {
+  stats->coveredEdges += covered;
+  if (covered < stats->minCoveredEdges) {
+    stats->minCoveredEdges = covered;
+  }
+  if (covered > stats->maxCoveredEdges) {
+    stats->maxCoveredEdges = covered;
+  }
+}
+
+#ifndef FRAMEWORK_LIBRARY
+// The peak resident size is that of the whole process, so in a sweep it also
+// covers the runs going on alongside.
+static void writeStatsReport(char *fileName, char *dataset, int userCount,
+                             int permissionCount, int mrcUser,
+                             int mrcPermission, Options *options,
+                             RunStats *stats) {
+  int formed = stats->roleCount == -1 ? 0 : stats->roleCount;
+  int mined = formed - stats->keptRoles;
+
+  FILE *file = openFile(fileName, "w");
+  fprintf(file, "{\n  \"dataset\": ");
+  writeJsonString(file, dataset);
+  fprintf(file, ",\n");
+  fprintf(file, "  \"users\": %d,\n", userCount);
+  fprintf(file, "  \"permissions\": %d,\n", permissionCount);
+  fprintf(file, "  \"edges\": %d,\n", stats->edges);
+  fprintf(file, "  \"mrcUser\": %d,\n", mrcUser);
+  fprintf(file, "  \"mrcPermission\": %d,\n", mrcPermission);
+  fprintf(file, "  \"threads\": %d,\n", options->threadCount);
+  fprintf(file, "  \"speculationDepth\": %d,\n", options->speculationDepth);
+  fprintf(file, "  \"setKernels\": \"%s\",\n", setKernels.name);
+  fprintf(file, "  \"feasible\": %s,\n",
+          stats->roleCount == -1 ? "false" : "true");
+  fprintf(file, "  \"roles\": %d,\n", formed);
+  fprintf(file, "  \"uncoveredEdges\": %d,\n", stats->uncoveredEdges);
+  fprintf(file,
+          "  \"seconds\": {\"load\": %.6f, \"phase1\": %.6f, "
+          "\"phase2\": %.6f, \"output\": %.6f, \"total\": %.6f},\n",
+          stats->loadSeconds, stats->phaseSeconds[0], stats->phaseSeconds[1],
+          stats->outputSeconds, stats->totalSeconds);
+  fprintf(file, "  \"selections\": {\"phase1\": %d, \"phase2\": %d},\n",
+          stats->selections[0], stats->selections[1]);
+  fprintf(file, "  \"formRoleCalls\": %d,\n", stats->formRoleCalls);
+  fprintf(file, "  \"dualFormRoleCalls\": %d,\n", stats->dualFormRoleCalls);
+  fprintf(file, "  \"rejectedRoles\": {\"duplicate\": %d, \"empty\": %d},\n",
+          stats->duplicateRoles, stats->emptyRoles);
+  fprintf(file,
+          "  \"coveredEdgesPerRole\": {\"min\": %d, \"max\": %d, "
+          "\"mean\": %.3f},\n",
+          mined > 0 ? stats->minCoveredEdges : 0, stats->maxCoveredEdges,
+          mined > 0 ? (double)stats->coveredEdges / mined : 0.0);
+  fprintf(file,
+          "  \"speculation\": {\"rounds\": %d, \"hits\": %d, "
+          "\"redrafts\": %d},\n",
+          stats->speculationRounds, stats->speculationHits,
+          stats->speculationRedrafts);
+  if (options->components) {
+    fprintf(file, "  \"components\": %d,\n", stats->components);
+  }
+  if (options->collapse) {
+    fprintf(file, "  \"collapsed\": {\"users\": %d, \"permissions\": %d},\n",
+            stats->collapsedUsers, stats->collapsedPermissions);
+  }
+  if (options->deltaFile != NULL) {
+    fprintf(file,
+            "  \"update\": {\"keptRoles\": %d, \"droppedRoles\": %d, "
+            "\"affectedUsers\": %d, \"minedFromScratch\": %s},\n",
+            stats->keptRoles, stats->droppedRoles, stats->affectedUsers,
+            stats->minedFromScratch ? "true" : "false");
+  }
+  fprintf(file, "  \"peakResidentKiB\": %ld\n}\n", stats->peakResidentKiB);
+  fclose(file);
+}
+
+static void writeJsonString(FILE *file, const char *string) {
+  fputc('"', file);
+  for (const char *c = string; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(file, "\\%c", *c);
+    } else if ((unsigned char)*c < 0x20) {
+      fprintf(file, "\\u%04x", *c);
+    } else {
+      fputc(*c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+// Parses a comma-separated list of mrcUser:mrcPermission pairs.
+static int parseConstraints(const char *list, int **constraints, int *count) {
+  const char *position = list;
+  while (1) {
+    char *end;
+    long mrcUser = strtol(position, &end, 10);
+    if (end == position || *end != ':') {
+      return 0;
+    }
+    position = end + 1;
+    long mrcPermission = strtol(position, &end, 10);
+    if (end == position || (*end != ',' && *end != '\0')) {
+      return 0;
+    }
+    addConstraints(constraints, count, mrcUser, mrcPermission);
+    if (*end == '\0') {
+      return 1;
+    }
+    position = end + 1;
+  }
+}
+
+static void addConstraints(int **constraints, int *count, int mrcUser,
+                           int mrcPermission) {
+  *constraints =
+      (int *)realloc(*constraints, 2 * (*count + 1) * sizeof(int));
+  (*constraints)[2 * *count] = mrcUser;
+  (*constraints)[2 * *count + 1] = mrcPermission;
+  (*count)++;
+}
+
+static void runSweep(void *arg, int worker, int workerCount) {
+  (void)worker;
+  (void)workerCount;
+  Sweep *sweep = (Sweep *)arg;
+  int c;
+  while ((c = __atomic_fetch_add(&sweep->next, 1, __ATOMIC_RELAXED)) <
+         sweep->count) {
+    int mrcUser = sweep->constraints[2 * c];
+    int mrcPermission = sweep->constraints[2 * c + 1];
+
+    // Each pair of a sweep writes UA/PA files of its own.
+    char dataset[strlen(sweep->dataset) + 32];
+    if (sweep->count > 1) {
+      sprintf(dataset, "%s_%d_%d", sweep->dataset, mrcUser, mrcPermission);
+    } else {
+      strcpy(dataset, sweep->dataset);
+    }
+    sweep->stats[c].loadSeconds = sweep->loadSeconds;
+    concurrentProcessingFramework(sweep->upa, sweep->userCount,
+                                  sweep->permissionCount, mrcUser,
+                                  mrcPermission, dataset, sweep->options,
+                                  sweep->reduction, sweep->prior,
+                                  &sweep->unenforced[c], &sweep->stats[c]);
+  }
+}
+
+// Throughput is the number of edges covered per second of Phase 1 and 2.
+static void printBenchReport(BenchSpec *bench, Sweep *sweep) {
+  printf("Planted UPA: %d users, %d permissions, %d roles, %d roles per user, "
+         "%d permissions per role, seed %llu\n",
+         bench->userCount, bench->permissionCount, bench->roleCount,
+         bench->rolesPerUser, bench->permissionsPerRole,
+         (unsigned long long)bench->seed);
+  printf("Edges: %d (density %.4f), generated in %.3f s\n",
+         sweep->stats[0].edges,
+         (double)sweep->stats[0].edges / bench->userCount /
+             bench->permissionCount,
+         sweep->loadSeconds);
+  printf("%8s %8s %8s %10s %14s %10s\n", "mrcUser", "mrcPerm", "roles",
+         "seconds", "edges/second", "peakKiB");
+  for (int c = 0; c < sweep->count; c++) {
+    RunStats *stats = &sweep->stats[c];
+    double seconds = stats->phaseSeconds[0] + stats->phaseSeconds[1];
+    double covered = stats->edges - stats->uncoveredEdges;
+    printf("%8d %8d ", sweep->constraints[2 * c],
+           sweep->constraints[2 * c + 1]);
+    if (stats->roleCount == -1) {
+      printf("%8s ", "-");
+    } else {
+      printf("%8d ", stats->roleCount);
+    }
+    printf("%10.4f %14.0f %10ld\n", seconds,
+           seconds > 0 ? covered / seconds : 0.0, stats->peakResidentKiB);
+  }
+}
+#endif
+
+// Covers the edges of a formed role, given as its users and the bit set P of
+// its permissions.
+static int modifyUC(UPA *UC, int *users, int userCount, uint64_t *P,
+                    DegreeIndex *degrees) {
+  int modifications = 0;
+
+  for (int u = 0; u < userCount; u++) {
+    int i = users[u];
+    if (UC->sparse) {
+      SparseMatrix *sparse = UC->sparse;
+      for (int k = sparse->rowOffsets[i]; k < sparse->rowOffsets[i + 1]; k++) {
+        if (GET_BIT(UC->edgeMask, k) && GET_BIT(P, sparse->colIndices[k])) {
+          CLEAR_BIT(UC->edgeMask, k);
+          if (degrees != NULL) {
+            coverEdge(degrees, i, sparse->colIndices[k]);
+          }
+          modifications++;
+        }
+      }
+    } else {
+      uint64_t *row = ROW(UC->matrix, i);
+      for (int v = 0; v < UC->matrix->words; v++) {
+        for (uint64_t y = row[v] & P[v]; y; y &= y - 1) {
+          int j = v * WORD_BITS + __builtin_ctzll(y);
+          CLEAR_BIT(ROW(UC->transpose, j), i);
+          if (degrees != NULL) {
+            coverEdge(degrees, i, j);
+          }
+          modifications++;
+        }
+        row[v] &= ~P[v];
+      }
+    }
   }
-  return datasetName;
+  return modifications;
 }
 
-void writeMatrixToFile(int **matrix, int rows, int cols, char *fileName) {
-  FILE *f = openFile(fileName, "w");
-
-  fprintf(f, "%d\n%d\n", rows, cols);
-
-  for (int i = 0; i < rows; i++) {
-    for (int j = 0; j < cols; j++) {
-      fprintf(f, "%d ", matrix[i][j]);
-    }
-    fprintf(f, "\n");
+static RoleDictionary *createRoleDictionary(int capacity) {
+  RoleDictionary *dictionary = (RoleDictionary *)malloc(sizeof(RoleDictionary));
+  dictionary->capacity = capacity;
+  dictionary->size = 0;
+  dictionary->hashes = (uint64_t *)malloc(capacity * sizeof(uint64_t));
+  dictionary->roles = (int *)malloc(capacity * sizeof(int));
+  for (int i = 0; i < capacity; i++) {
+    dictionary->roles[i] = -1;
   }
-
-  fclose(f);
+  return dictionary;
 }
 
-void writeMatrixTransposeToFile(int **matrix, int rows, int cols,
-                                char *fileName) {
-  FILE *f = openFile(fileName, "w");
+static void freeRoleDictionary(RoleDictionary *dictionary) {
+  free(dictionary->hashes);
+  free(dictionary->roles);
+  free(dictionary);
+}
 
-  fprintf(f, "%d\n%d\n", cols, rows);
+// splitmix64 finalizer applied to the running hash combined with value.
+static uint64_t mixHash(uint64_t hash, uint64_t value) {
+  uint64_t z = hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) +
+                       (hash >> 2));
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
 
-  for (int j = 0; j < cols; j++) {
-    for (int i = 0; i < rows; i++) {
-      fprintf(f, "%d ", matrix[i][j]);
-    }
-    fprintf(f, "\n");
+// Hashes the sorted users and then the sorted permissions of a role.
+static uint64_t hashRole(int *users, int userCount, int *permissions,
+                         int permissionCount) {
+  uint64_t hash = 0;
+  for (int k = 0; k < userCount; k++) {
+    hash = mixHash(hash, users[k]);
   }
-
-  fclose(f);
+  hash = mixHash(hash, UINT64_MAX);
+  for (int k = 0; k < permissionCount; k++) {
+    hash = mixHash(hash, permissions[k]);
+  }
+  return hash;
 }
 
-int **readUPAMatrix(FILE *f, int userCount, int permissionCount) {
-  int **upaMatrix = (int **)malloc(userCount * sizeof(int *));
-  for (int i = 0; i < userCount; i++) {
-    upaMatrix[i] = (int *)malloc(permissionCount * sizeof(int));
-    for (int j = 0; j < permissionCount; j++) {
-      upaMatrix[i][j] = 0;
+static void insertRole(RoleDictionary *dictionary, uint64_t hash, int role) {
+  if (2 * (dictionary->size + 1) > dictionary->capacity) {
+    RoleDictionary *larger = createRoleDictionary(2 * dictionary->capacity);
+    for (int i = 0; i < dictionary->capacity; i++) {
+      if (dictionary->roles[i] != -1) {
+        insertRole(larger, dictionary->hashes[i], dictionary->roles[i]);
+      }
     }
+    free(dictionary->hashes);
+    free(dictionary->roles);
+    *dictionary = *larger;
+    free(larger);
   }
 
-  int i, j;
-
-  while (fscanf(f, " %d %d", &i, &j) != EOF) {
-    upaMatrix[i - 1][j - 1] = 1;
+  int slot = hash & (dictionary->capacity - 1);
+  while (dictionary->roles[slot] != -1) {
+    slot = (slot + 1) & (dictionary->capacity - 1);
   }
-
-  return upaMatrix;
+  dictionary->hashes[slot] = hash;
+  dictionary->roles[slot] = role;
+  dictionary->size++;
 }
 
-void freeMatrix(int **matrix, int rows) {
-  for (int i = 0; i < rows; i++) {
-    free(matrix[i]);
-  }
-  free(matrix);
+static RoleStore *createRoleStore(int userCount, int permissionCount) {
+  RoleStore *roles = (RoleStore *)malloc(sizeof(RoleStore));
+  roles->userCount = userCount;
+  roles->permissionCount = permissionCount;
+  roles->count = 0;
+  roles->capacity = 64;
+  roles->userOffsets = (int *)malloc((roles->capacity + 1) * sizeof(int));
+  roles->permOffsets = (int *)malloc((roles->capacity + 1) * sizeof(int));
+  roles->userOffsets[0] = 0;
+  roles->permOffsets[0] = 0;
+  roles->userCapacity = 1024;
+  roles->permCapacity = 1024;
+  roles->users = (int *)malloc(roles->userCapacity * sizeof(int));
+  roles->permissions = (int *)malloc(roles->permCapacity * sizeof(int));
+  roles->dictionary = createRoleDictionary(64);
+  roles->duplicates = 0;
+  roles->empty = 0;
+  return roles;
 }
 
-int **copyMatrix(int **matrix, int rows, int cols) {
-  int **copy = (int **)malloc(rows * sizeof(int *));
-  for (int i = 0; i < rows; i++) {
-    copy[i] = (int *)malloc(cols * sizeof(int));
-    for (int j = 0; j < cols; j++) {
-      copy[i][j] = matrix[i][j];
-    }
-  }
-  return copy;
+static void freeRoleStore(RoleStore *roles) {
+  free(roles->userOffsets);
+  free(roles->permOffsets);
+  free(roles->users);
+  free(roles->permissions);
+  freeRoleDictionary(roles->dictionary);
+  free(roles);
 }
 
-int isSubset(int *a, int *b, int size) {
-  for (int i = 0; i < size; i++) {
-    if (a[i] == 1 && b[i] != 1) {
-      return 0;
+// Gives every role of a collapsed UPA to all the vertices its collapsed
+// vertices stand for.
+static RoleStore *expandRoles(RoleStore *roles, Reduction *reduction,
+                              int userCount, int permissionCount) {
+  RoleStore *expanded = createRoleStore(userCount, permissionCount);
+  int *users = (int *)malloc((userCount + 1) * sizeof(int));
+  int *permissions = (int *)malloc((permissionCount + 1) * sizeof(int));
+  for (int r = 0; r < roles->count; r++) {
+    int roleUsers = 0, rolePermissions = 0;
+    for (int k = roles->userOffsets[r]; k < roles->userOffsets[r + 1]; k++) {
+      int c = roles->users[k];
+      for (int m = reduction->userMemberOffsets[c];
+           m < reduction->userMemberOffsets[c + 1]; m++) {
+        users[roleUsers++] = reduction->userMembers[m];
+      }
     }
-  }
-  return 1;
-}
-
-int hasElement(int *a, int *b, int size) {
-  for (int i = 0; i < size; i++) {
-    if (a[i] == 1 && b[i] == 1) {
-      return 1;
+    for (int k = roles->permOffsets[r]; k < roles->permOffsets[r + 1]; k++) {
+      int c = roles->permissions[k];
+      for (int m = reduction->permMemberOffsets[c];
+           m < reduction->permMemberOffsets[c + 1]; m++) {
+        permissions[rolePermissions++] = reduction->permMembers[m];
+      }
     }
+    qsort(users, roleUsers, sizeof(int), compareIndices);
+    qsort(permissions, rolePermissions, sizeof(int), compareIndices);
+    addRole(expanded, users, roleUsers, permissions, rolePermissions,
+            hashRole(users, roleUsers, permissions, rolePermissions));
   }
-  return 0;
+  expanded->duplicates = roles->duplicates;
+  expanded->empty = roles->empty;
+  free(users);
+  free(permissions);
+  return expanded;
 }
 
-Vertex selectVertexWithHeuristic(int **UC, int userCount, int permissionCount,
-                                 int *userRoleCount, int *permRoleCount,
-                                 int mrcUser, int mrcPerm) {
-  int min = userCount + permissionCount;
+#ifndef FRAMEWORK_LIBRARY
+// Reads the UA and PA files the previous run wrote for dataset and the delta
+// of options, and keeps the roles no removed edge invalidates. The delta is
+// relative to the UPA that run mined, and upa is that UPA with it applied.
+static PriorRoles *loadPriorRoles(UPA *upa, char *dataset, Options *options) {
+  int userCount = upa->userCount, permissionCount = upa->permissionCount;
+  char uaFile[strlen(dataset) + 32], paFile[strlen(dataset) + 32];
+  roleFileName(uaFile, dataset, "UA", options);
+  roleFileName(paFile, dataset, "PA", options);
 
-  /* printf("user count: %d\n", userCount); */
-  /* printf("permission count: %d\n", permissionCount); */
+  // UA lists the roles of each user, PA the permissions of each role.
+  int uaRows, roleCount, paRows, paCols;
+  int *userRoleOffsets, *userRoles, *permOffsets, *permissions;
+  readMatrixFile(uaFile, options, &uaRows, &roleCount, &userRoleOffsets,
+                 &userRoles);
+  readMatrixFile(paFile, options, &paRows, &paCols, &permOffsets,
+                 &permissions);
+  if (uaRows != userCount || paRows != roleCount || paCols != permissionCount) {
+    fprintf(stderr, "%s and %s do not match the UPA\n", uaFile, paFile);
+    exit(1);
+  }
 
-  Vertex v = {-1, PERMISSION};
+  PriorRoles *prior = (PriorRoles *)calloc(1, sizeof(PriorRoles));
+  prior->affectedUsers =
+      (uint64_t *)calloc(WORDS(userCount) + 1, sizeof(uint64_t));
+  int *removed, removedCount;
+  readDelta(options->deltaFile, upa, prior->affectedUsers, &removed,
+            &removedCount);
 
-  for (int j = 0; j < permissionCount; j++) {
-    int uncoveredEdges = 0;
-    for (int i = 0; i < userCount; i++) {
-      if (UC[i][j] == 1 && userRoleCount[i] < mrcUser - 1) {
-        uncoveredEdges++;
+  // A role is dropped with the first removed edge it holds.
+  unsigned char *dropped = (unsigned char *)calloc(roleCount + 1, 1);
+  for (int e = 0; e < removedCount; e++) {
+    int i = removed[2 * e], j = removed[2 * e + 1];
+    for (int k = userRoleOffsets[i]; k < userRoleOffsets[i + 1]; k++) {
+      int r = userRoles[k];
+      if (!dropped[r] &&
+          bsearch(&j, permissions + permOffsets[r],
+                  permOffsets[r + 1] - permOffsets[r], sizeof(int),
+                  compareIndices) != NULL) {
+        dropped[r] = 1;
+        prior->dropped++;
       }
     }
-
-    if (uncoveredEdges > 0 && uncoveredEdges < min) {
-      min = uncoveredEdges;
-      v.index = j;
-      v.type = PERMISSION;
-    }
   }
+  free(removed);
 
+  // Regroup UA by role, keeping only the roles left, and mark the users of
+  // dropped roles as affected.
+  int *roleUserOffsets = (int *)calloc(roleCount + 1, sizeof(int));
   for (int i = 0; i < userCount; i++) {
-    int uncoveredEdges = 0;
-    for (int j = 0; j < permissionCount; j++) {
-      if (UC[i][j] == 1 && permRoleCount[j] < mrcPerm - 1) {
-        uncoveredEdges++;
+    for (int k = userRoleOffsets[i]; k < userRoleOffsets[i + 1]; k++) {
+      roleUserOffsets[userRoles[k] + 1]++;
+      if (dropped[userRoles[k]]) {
+        SET_BIT(prior->affectedUsers, i);
       }
     }
+  }
+  for (int r = 0; r < roleCount; r++) {
+    roleUserOffsets[r + 1] += roleUserOffsets[r];
+  }
+  int *roleUsers =
+      (int *)malloc((roleUserOffsets[roleCount] + 1) * sizeof(int));
+  int *next = (int *)malloc((roleCount + 1) * sizeof(int));
+  memcpy(next, roleUserOffsets, (roleCount + 1) * sizeof(int));
+  for (int i = 0; i < userCount; i++) {
+    for (int k = userRoleOffsets[i]; k < userRoleOffsets[i + 1]; k++) {
+      roleUsers[next[userRoles[k]]++] = i;
+    }
+  }
+  free(next);
 
-    if (uncoveredEdges > 0 &&
-        (uncoveredEdges < min ||
-         (uncoveredEdges == min && v.type == PERMISSION))) {
-      min = uncoveredEdges;
-      v.index = i;
-      v.type = USER;
+  // Kept roles are renumbered in order, and so are the role lists of users.
+  prior->kept = createRoleStore(userCount, permissionCount);
+  int *keptIndex = (int *)malloc((roleCount + 1) * sizeof(int));
+  for (int r = 0; r < roleCount; r++) {
+    keptIndex[r] = dropped[r] ? -1 : prior->kept->count;
+    if (!dropped[r]) {
+      int *users = roleUsers + roleUserOffsets[r];
+      int *perms = permissions + permOffsets[r];
+      int n = roleUserOffsets[r + 1] - roleUserOffsets[r];
+      int m = permOffsets[r + 1] - permOffsets[r];
+      addRole(prior->kept, users, n, perms, m, hashRole(users, n, perms, m));
+    }
+  }
+  int kept = 0;
+  for (int i = 0; i < userCount; i++) {
+    int start = kept;
+    for (int k = userRoleOffsets[i]; k < userRoleOffsets[i + 1]; k++) {
+      if (keptIndex[userRoles[k]] != -1) {
+        userRoles[kept++] = keptIndex[userRoles[k]];
+      }
     }
+    userRoleOffsets[i] = start;
   }
+  userRoleOffsets[userCount] = kept;
+  prior->userRoleOffsets = userRoleOffsets;
+  prior->userRoles = userRoles;
 
-  printf("Count: %d\n", min);
+  for (int w = 0; w < WORDS(userCount); w++) {
+    prior->affectedCount += __builtin_popcountll(prior->affectedUsers[w]);
+  }
 
-  return v;
+  free(keptIndex);
+  free(dropped);
+  free(roleUsers);
+  free(roleUserOffsets);
+  free(permOffsets);
+  free(permissions);
+  return prior;
 }
 
-Vertex selectVertexWithMaxUncoveredIncidentEdges(int **UC, int userCount,
-                                                 int permissionCount,
-                                                 int *userRoleCount,
-                                                 int *permRoleCount, int mrUser,
-                                                 int mrcPerm) {
-  int max = 0;
-
-  Vertex v = {-1, USER};
+// Reads a delta file: one edge per line as in a UPA file, preceded by + if it
+// was added or - if it was removed. Added edges must be in upa and removed
+// ones not. The users of added edges are marked in affectedUsers; removed
+// edges are returned as user, permission pairs.
+static void readDelta(char *fileName, UPA *upa, uint64_t *affectedUsers,
+                      int **removed, int *removedCount) {
+  size_t size;
+  char *data = readFileContents(fileName, 0, &size);
+  const char *p = data, *end = data + size;
+  int capacity = 64;
+  *removed = (int *)malloc(2 * capacity * sizeof(int));
+  *removedCount = 0;
 
-  for (int i = 0; i < userCount; i++) {
-    if (userRoleCount[i] >= mrUser - 1) {
+  while ((p = skipBlanks(p, end)) < end) {
+    const char *line = p;
+    char sign = *p++;
+    long i, j;
+    p = parseIndex(skipBlanks(p, end), end, &i);
+    if (p != NULL) {
+      p = parseIndex(skipBlanks(p, end), end, &j);
+    }
+    if ((sign != '+' && sign != '-') || p == NULL) {
+      reportParseError(fileName, data, line, "expected + or - and an edge");
+    }
+    if (i < 1 || i > upa->userCount || j < 1 || j > upa->permissionCount) {
+      reportParseError(fileName, data, line, "edge out of range");
+    }
+    if (hasEdge(upa, i - 1, j - 1) != (sign == '+')) {
+      reportParseError(fileName, data, line,
+                       sign == '+' ? "added edge is not in the UPA"
+                                   : "removed edge is still in the UPA");
+    }
+    if (sign == '+') {
+      SET_BIT(affectedUsers, i - 1);
       continue;
     }
+    if (*removedCount == capacity) {
+      capacity *= 2;
+      *removed = (int *)realloc(*removed, 2 * capacity * sizeof(int));
+    }
+    (*removed)[2 * *removedCount] = i - 1;
+    (*removed)[2 * *removedCount + 1] = j - 1;
+    (*removedCount)++;
+  }
+  free(data);
+}
 
-    int count = 0;
-    for (int j = 0; j < permissionCount; j++) {
-      if (UC[i][j] == 1) {
-        count++;
-      }
+// Parses -u: the delta file, optionally followed by ":mrcUser:mrcPermission",
+// the constraints the roles to update were mined for. The pair is cut off
+// spec, and left at 0 when absent.
+static int parseDeltaSpec(char *spec, int *mrcUser, int *mrcPerm) {
+  *mrcUser = *mrcPerm = 0;
+  char *second = strrchr(spec, ':');
+  if (second == NULL || second == spec) {
+    return 1;
+  }
+  char *first = second - 1;
+  while (first > spec && *first != ':') {
+    first--;
+  }
+  if (*first != ':') {
+    return 1;
+  }
+  char *end;
+  long user = strtol(first + 1, &end, 10);
+  if (end == first + 1 || end != second) {
+    return 1;
+  }
+  long perm = strtol(second + 1, &end, 10);
+  if (end == second + 1 || *end != '\0') {
+    return 1;
+  }
+  if (user < 1 || user > INT_MAX || perm < 1 || perm > INT_MAX ||
+      first == spec) {
+    return 0;
+  }
+  *mrcUser = user;
+  *mrcPerm = perm;
+  *first = '\0';
+  return 1;
+}
+#endif
+
+// Puts the kept roles into roles, counts them against their members and
+// covers their edges in UC. Rows of unaffected users are covered in full,
+// since the kept roles cover exactly what they did before; only affected rows
+// are matched against the roles of their users.
+static void seedPriorRoles(PriorRoles *prior, UPA *UC, RoleStore *roles,
+                           int *userRoleCount, int *permRoleCount) {
+  RoleStore *kept = prior->kept;
+  for (int r = 0; r < kept->count; r++) {
+    int *users = kept->users + kept->userOffsets[r];
+    int *perms = kept->permissions + kept->permOffsets[r];
+    int n = kept->userOffsets[r + 1] - kept->userOffsets[r];
+    int m = kept->permOffsets[r + 1] - kept->permOffsets[r];
+    addRole(roles, users, n, perms, m, hashRole(users, n, perms, m));
+    for (int k = 0; k < n; k++) {
+      userRoleCount[users[k]]++;
     }
-    /* printf("User: %d count: %d\n", i, count); */
-    if (count > max) {
-      max = count;
-      v.index = i;
-      printf("User: %d chosen for count %d\n", i, count);
+    for (int k = 0; k < m; k++) {
+      permRoleCount[perms[k]]++;
     }
   }
 
-  for (int j = 0; j < permissionCount; j++) {
-    if (permRoleCount[j] >= mrcPerm - 1) {
+  int words = WORDS(UC->permissionCount);
+  uint64_t *all = (uint64_t *)malloc((words + 1) * sizeof(uint64_t));
+  uint64_t *covered = (uint64_t *)calloc(words + 1, sizeof(uint64_t));
+  memset(all, 0xff, (words + 1) * sizeof(uint64_t));
+  for (int i = 0; i < UC->userCount; i++) {
+    if (!GET_BIT(prior->affectedUsers, i)) {
+      modifyUC(UC, &i, 1, all, NULL);
       continue;
     }
-
-    int count = 0;
-    for (int i = 0; i < userCount; i++) {
-      if (UC[i][j] == 1) {
-        count++;
+    for (int k = prior->userRoleOffsets[i]; k < prior->userRoleOffsets[i + 1];
+         k++) {
+      int r = prior->userRoles[k];
+      for (int l = kept->permOffsets[r]; l < kept->permOffsets[r + 1]; l++) {
+        SET_BIT(covered, kept->permissions[l]);
       }
     }
-    /* printf("Permission: %d count: %d\n", j, count); */
-    if (count > max) {
-      max = count;
-      v.index = j;
-      v.type = PERMISSION;
-      printf("Permission: %d chosen for count %d\n", j, count);
+    modifyUC(UC, &i, 1, covered, NULL);
+    memset(covered, 0, (words + 1) * sizeof(uint64_t));
+  }
+  free(all);
+  free(covered);
+}
+
+// Whether no user is in more than mrcUser of roles and no permission in more
+// than mrcPerm.
+static int rolesFit(RoleStore *roles, int mrcUser, int mrcPerm) {
+  int *userRoleCount = (int *)calloc(roles->userCount + 1, sizeof(int));
+  int *permRoleCount = (int *)calloc(roles->permissionCount + 1, sizeof(int));
+  int fit = 1;
+  for (int k = 0; fit && k < roles->userOffsets[roles->count]; k++) {
+    fit = ++userRoleCount[roles->users[k]] <= mrcUser;
+  }
+  for (int k = 0; fit && k < roles->permOffsets[roles->count]; k++) {
+    fit = ++permRoleCount[roles->permissions[k]] <= mrcPerm;
+  }
+  free(userRoleCount);
+  free(permRoleCount);
+  return fit;
+}
+
+#ifndef FRAMEWORK_LIBRARY
+static void freePriorRoles(PriorRoles *prior) {
+  freeRoleStore(prior->kept);
+  free(prior->affectedUsers);
+  free(prior->userRoleOffsets);
+  free(prior->userRoles);
+  free(prior);
+}
+#endif
+
+// Appends count elements to the list *members, currently length long, and
+// returns the new length.
+static int appendMembers(int **members, int *capacity, int length, int *added,
+                         int count) {
+  if (length + count > *capacity) {
+    while (length + count > *capacity) {
+      *capacity *= 2;
     }
+    *members = (int *)realloc(*members, *capacity * sizeof(int));
   }
-  return v;
+  memcpy(*members + length, added, count * sizeof(int));
+  return length + count;
 }
 
-int hasUncoveredEdges(int **UC, int userCount, int permissionCount) {
-  for (int i = 0; i < userCount; i++) {
-    for (int j = 0; j < permissionCount; j++) {
-      if (UC[i][j] == 1) {
-        return 1;
-      }
+// users and permissions are sorted, like the lists the store keeps.
+static void addRole(RoleStore *roles, int *users, int userCount,
+                    int *permissions, int permissionCount, uint64_t hash) {
+  if (roles->count == roles->capacity) {
+    roles->capacity *= 2;
+    roles->userOffsets = (int *)realloc(roles->userOffsets,
+                                        (roles->capacity + 1) * sizeof(int));
+    roles->permOffsets = (int *)realloc(roles->permOffsets,
+                                        (roles->capacity + 1) * sizeof(int));
+  }
+
+  int r = roles->count;
+  roles->userOffsets[r + 1] =
+      appendMembers(&roles->users, &roles->userCapacity,
+                    roles->userOffsets[r], users, userCount);
+  roles->permOffsets[r + 1] =
+      appendMembers(&roles->permissions, &roles->permCapacity,
+                    roles->permOffsets[r], permissions, permissionCount);
+  roles->count++;
+
+  insertRole(roles->dictionary, hash, r);
+}
+
+static int uniqueRole(int *users, int userCount, int *permissions,
+                      int permissionCount, uint64_t hash, RoleStore *roles) {
+  RoleDictionary *dictionary = roles->dictionary;
+  int slot = hash & (dictionary->capacity - 1);
+  while (dictionary->roles[slot] != -1) {
+    int r = dictionary->roles[slot];
+    if (dictionary->hashes[slot] == hash &&
+        roles->userOffsets[r + 1] - roles->userOffsets[r] == userCount &&
+        roles->permOffsets[r + 1] - roles->permOffsets[r] == permissionCount &&
+        memcmp(roles->users + roles->userOffsets[r], users,
+               userCount * sizeof(int)) == 0 &&
+        memcmp(roles->permissions + roles->permOffsets[r], permissions,
+               permissionCount * sizeof(int)) == 0) {
+      return 0;
     }
+    slot = (slot + 1) & (dictionary->capacity - 1);
   }
-  return 0;
+  return 1;
 }
 
-// Alogrithm 4
-int concurrentProcessingFramework(int **upaMatrix, int userCount,
-                                  int permissionCount, int mrcUser, int mrcPerm,
-                                  char *dataset) {
-  int userRoleCount[userCount];
+static void printRoleState(uint64_t *U, uint64_t *P, int *userRoleCount,
+                           int *permRoleCount, int userCount,
+                           int permissionCount) {
+  printf("U: \n");
   for (int i = 0; i < userCount; i++) {
-    userRoleCount[i] = 0;
+    printf("%d ", (int)GET_BIT(U, i));
   }
-  int permRoleCount[permissionCount];
+  printf("\nP: \n");
   for (int i = 0; i < permissionCount; i++) {
-    permRoleCount[i] = 0;
+    printf("%d ", (int)GET_BIT(P, i));
   }
-  int **uaMatrix = (int **)malloc(userCount * sizeof(int *));
+  printf("\nUser role count: \n");
   for (int i = 0; i < userCount; i++) {
-    uaMatrix[i] = (int *)malloc(MAX_ROLES * sizeof(int));
-    for (int j = 0; j < MAX_ROLES; j++) {
-      uaMatrix[i][j] = 0;
-    }
+    printf("%d ", userRoleCount[i]);
   }
-  int **paMatrix = (int **)malloc(permissionCount * sizeof(int *));
+  printf("\nPermission role count: \n");
   for (int i = 0; i < permissionCount; i++) {
-    paMatrix[i] = (int *)malloc(MAX_ROLES * sizeof(int));
-    for (int j = 0; j < MAX_ROLES; j++) {
-      paMatrix[i][j] = 0;
-    }
+    printf("%d ", permRoleCount[i]);
   }
-  int **UC = copyMatrix(upaMatrix, userCount, permissionCount);
+  printf("\n");
+}
 
-  int roleCount = 0;
+static ScratchArena *createScratchArena(size_t size) {
+  ScratchArena *arena = (ScratchArena *)malloc(sizeof(ScratchArena));
+  arena->base = (char *)aligned_alloc(ARENA_ALIGNMENT, arenaSize(size));
+  if (arena->base == NULL) {
+    perror("Unable to allocate the scratch arena: ");
+    exit(1);
+  }
+  memset(arena->base, 0, arenaSize(size));
+  arena->size = arenaSize(size);
+  arena->used = 0;
+  return arena;
+}
 
-  int i = 0, j = 0;
+static void freeScratchArena(ScratchArena *arena) {
+  free(arena->base);
+  free(arena);
+}
 
-  int loopCount = 0;
+// Callers size the arena up front, so running out of it is a bug.
+static void *arenaAlloc(ScratchArena *arena, size_t size) {
+  if (arena->size - arena->used < arenaSize(size)) {
+    fprintf(stderr, "Scratch arena of %zu bytes exhausted\n", arena->size);
+    abort();
+  }
+  void *piece = arena->base + arena->used;
+  arena->used += arenaSize(size);
+  return piece;
+}
 
-  int remainingUncoveredEdges = 0;
+// The space a piece of size bytes takes up in an arena.
+static size_t arenaSize(size_t size) {
+  return (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+}
 
-  for (int i = 0; i < userCount; i++) {
-    for (int j = 0; j < permissionCount; j++) {
-      remainingUncoveredEdges += UC[i][j];
-    }
-  }
+static RoleDraft *createRoleDraft(ScratchArena *arena, int userCount,
+                                  int permissionCount) {
+  size_t userSize = (WORDS(userCount) + 1) * sizeof(uint64_t);
+  size_t permissionSize = (WORDS(permissionCount) + 1) * sizeof(uint64_t);
 
-  // Phase 1
-  printf("Phase 1\n");
-  for (int i = 0; i < userCount; i++) {
-    for (int j = 0; j < permissionCount; j++) {
-      loopCount++;
-      if (loopCount % 1000 == 0) {
-        printf("Phase 1 Loop %d: Remaining uncovered edges: %d\n", loopCount,
-               remainingUncoveredEdges);
-      }
-      if (remainingUncoveredEdges == 0) {
-        break;
-      }
-      if (UC[i][j] == 1 &&
-          (userRoleCount[i] < mrcUser - 1 || permRoleCount[j] < mrcPerm - 1)) {
-        int U[userCount], P[permissionCount];
-        for (int k = 0; k < userCount; k++) {
-          U[k] = 0;
-        }
-        for (int k = 0; k < permissionCount; k++) {
-          P[k] = 0;
-        }
+  RoleDraft *draft = (RoleDraft *)arenaAlloc(arena, sizeof(RoleDraft));
+  draft->vertex.index = -1;
+  draft->vertex.type = USER;
+  draft->U = (uint64_t *)arenaAlloc(arena, userSize);
+  draft->P = (uint64_t *)arenaAlloc(arena, permissionSize);
+  draft->userRaised = (uint64_t *)arenaAlloc(arena, userSize);
+  draft->permRaised = (uint64_t *)arenaAlloc(arena, permissionSize);
+  draft->accepted = (unsigned char *)arenaAlloc(
+      arena, (userCount > permissionCount ? userCount : permissionCount) + 1);
+  draft->touchedUsers = (int *)arenaAlloc(arena, (userCount + 1) * sizeof(int));
+  draft->touchedPerms =
+      (int *)arenaAlloc(arena, (permissionCount + 1) * sizeof(int));
+  draft->touchedUserCount = 0;
+  draft->touchedPermCount = 0;
+  draft->userTouched = (uint64_t *)arenaAlloc(arena, userSize);
+  draft->permTouched = (uint64_t *)arenaAlloc(arena, permissionSize);
+  return draft;
+}
 
-        Vertex vertex = selectVertexWithHeuristic(
-            UC, userCount, permissionCount, userRoleCount, permRoleCount,
-            mrcUser, mrcPerm);
+// The arena space createRoleDraft takes.
+static size_t roleDraftSize(int userCount, int permissionCount) {
+  size_t userSize = (WORDS(userCount) + 1) * sizeof(uint64_t);
+  size_t permissionSize = (WORDS(permissionCount) + 1) * sizeof(uint64_t);
+  return arenaSize(sizeof(RoleDraft)) + 3 * arenaSize(userSize) +
+         3 * arenaSize(permissionSize) +
+         arenaSize((userCount > permissionCount ? userCount : permissionCount) +
+                   1) +
+         arenaSize((userCount + 1) * sizeof(int)) +
+         arenaSize((permissionCount + 1) * sizeof(int));
+}
 
-        if (vertex.index == -1) {
-          printf("No vertex selected\n");
-          continue;
-        }
+// Clears everything set in the draft since the last reset.
+static void resetRoleDraft(RoleDraft *draft) {
+  for (int k = 0; k < draft->touchedUserCount; k++) {
+    int i = draft->touchedUsers[k];
+    CLEAR_BIT(draft->U, i);
+    CLEAR_BIT(draft->userRaised, i);
+    CLEAR_BIT(draft->userTouched, i);
+  }
+  for (int k = 0; k < draft->touchedPermCount; k++) {
+    int j = draft->touchedPerms[k];
+    CLEAR_BIT(draft->P, j);
+    CLEAR_BIT(draft->permRaised, j);
+    CLEAR_BIT(draft->permTouched, j);
+  }
+  draft->touchedUserCount = 0;
+  draft->touchedPermCount = 0;
+}
 
-        if (vertex.type == USER) {
-          formRoleProcedure(vertex.index, userCount, permissionCount, U, P, UC,
-                            upaMatrix, mrcUser, mrcPerm, userRoleCount,
-                            permRoleCount, uaMatrix, paMatrix, &roleCount);
-        } else if (vertex.type == PERMISSION) {
-          dualFormRoleProcedure(vertex.index, U, P, UC, upaMatrix, mrcPerm,
-                                mrcPerm, userRoleCount, permRoleCount, uaMatrix,
-                                paMatrix, userCount, permissionCount,
-                                &roleCount);
-        }
-        remainingUncoveredEdges =
-            remainingUncoveredEdges -
-            modifyUC(UC, U, P, userCount, permissionCount);
-      }
-    }
-    if (remainingUncoveredEdges == 0) {
-      break;
+// Adds user i, or permission i, to the draft, raising its role count on
+// commit if raised is set.
+static void addDraftMember(RoleDraft *draft, int permission, int i,
+                           int raised) {
+  uint64_t *touched = permission ? draft->permTouched : draft->userTouched;
+  if (!GET_BIT(touched, i)) {
+    SET_BIT(touched, i);
+    if (permission) {
+      draft->touchedPerms[draft->touchedPermCount++] = i;
+    } else {
+      draft->touchedUsers[draft->touchedUserCount++] = i;
     }
   }
+  SET_BIT(permission ? draft->P : draft->U, i);
+  if (raised) {
+    SET_BIT(permission ? draft->permRaised : draft->userRaised, i);
+  }
+}
 
-  i = 0;
-  j = 0;
-  loopCount = 0;
-
-  // Phase 2
-  printf("Phase 2\n");
-  for (int i = 0; i < userCount; i++) {
-    for (int j = 0; j < permissionCount; j++) {
-      loopCount++;
-      if (loopCount % 1000 == 0) {
-        printf("Phase 2 Loop %d: Remaining uncovered edges: %d\n", loopCount,
-               remainingUncoveredEdges);
-      }
-      if (remainingUncoveredEdges == 0) {
-        break;
-      }
-
-      if (UC[i][j] == 1 && (userRoleCount[i] == mrcUser - 1 ||
-                            permRoleCount[j] == mrcPerm - 1)) {
-        int U[userCount], P[permissionCount];
-        for (int k = 0; k < userCount; k++) {
-          U[k] = 0;
-        }
-        for (int k = 0; k < permissionCount; k++) {
-          P[k] = 0;
-        }
-
-        Vertex vertex = selectVertexWithMaxUncoveredIncidentEdges(
-            UC, userCount, permissionCount, userRoleCount, permRoleCount,
-            mrcUser, mrcPerm);
-        printf("Vertex: %d type %d\n", vertex.index, vertex.type);
-
-        if (vertex.index == -1) {
-          printf("No vertex selected\n");
-          break;
-        }
+// Drops from the undo log whatever a revision took out of U or P again and
+// sorts the rest. The raised sets are subsets of U and P.
+static void compactRoleDraft(RoleDraft *draft) {
+  int count = 0;
+  for (int k = 0; k < draft->touchedUserCount; k++) {
+    int i = draft->touchedUsers[k];
+    if (GET_BIT(draft->U, i)) {
+      draft->touchedUsers[count++] = i;
+    } else {
+      CLEAR_BIT(draft->userTouched, i);
+    }
+  }
+  draft->touchedUserCount = count;
+  count = 0;
+  for (int k = 0; k < draft->touchedPermCount; k++) {
+    int j = draft->touchedPerms[k];
+    if (GET_BIT(draft->P, j)) {
+      draft->touchedPerms[count++] = j;
+    } else {
+      CLEAR_BIT(draft->permTouched, j);
+    }
+  }
+  draft->touchedPermCount = count;
+  qsort(draft->touchedUsers, draft->touchedUserCount, sizeof(int),
+        compareIndices);
+  qsort(draft->touchedPerms, draft->touchedPermCount, sizeof(int),
+        compareIndices);
+}
 
-        if (vertex.type == USER) {
-          int condition = 1;
-          for (int k = 0; k < permissionCount; k++) {
-            if (UC[vertex.index][k] == 1) {
-              P[k] = 1;
-              if (permRoleCount[k] > mrcPerm - 1) {
-                condition = 0;
-              }
-            }
-          }
-          if (condition) {
-            formRoleProcedure(vertex.index, userCount, permissionCount, U, P,
-                              UC, upaMatrix, mrcUser, mrcPerm, userRoleCount,
-                              permRoleCount, uaMatrix, paMatrix, &roleCount);
-          }
-        } else if (vertex.type == PERMISSION) {
-          int condition = 1;
-          for (int k = 0; k < userCount; k++) {
-            printf("%d\n", UC[k][vertex.index]);
-            if (UC[k][vertex.index] == 1) {
-              U[k] = 1;
-              if (userRoleCount[k] > mrcUser - 1) {
-                condition = 0;
-              }
-            }
-          }
-          if (condition) {
-            dualFormRoleProcedure(vertex.index, U, P, UC, upaMatrix, mrcUser,
-                                  mrcPerm, userRoleCount, permRoleCount,
-                                  uaMatrix, paMatrix, userCount,
-                                  permissionCount, &roleCount);
-          }
-        }
+static int compareIndices(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
 
-        remainingUncoveredEdges =
-            remainingUncoveredEdges -
-            modifyUC(UC, U, P, userCount, permissionCount);
-      }
+// Applies a formed role's counts through the degree index. Only members of U
+// and P can have had their counts raised.
+static void commitRoleCounts(DegreeIndex *degrees, UPA *UC, RoleDraft *draft) {
+  for (int k = 0; k < draft->touchedUserCount; k++) {
+    int i = draft->touchedUsers[k];
+    int count = degrees->userRoleCount[i] +
+                (int)GET_BIT(draft->userRaised, i) +
+                (draft->vertex.type == USER && draft->vertex.index == i);
+    if (count != degrees->userRoleCount[i]) {
+      setUserRoleCount(degrees, UC, i, count);
     }
-    if (remainingUncoveredEdges == 0) {
-      break;
+  }
+  for (int k = 0; k < draft->touchedPermCount; k++) {
+    int j = draft->touchedPerms[k];
+    int count = degrees->permRoleCount[j] +
+                (int)GET_BIT(draft->permRaised, j) +
+                (draft->vertex.type == PERMISSION && draft->vertex.index == j);
+    if (count != degrees->permRoleCount[j]) {
+      setPermRoleCount(degrees, UC, j, count);
     }
   }
+}
 
-  for (int i = 0; i < userCount; i++) {
-    for (int j = 0; j < permissionCount; j++) {
-      if (UC[i][j] == 1) {
-        printf("The given set of constraints cannot be enforced\n");
-        roleCount = -1;
-        for (int k = 0; k < userCount; k++) {
-          for (int l = 0; l < permissionCount; l++) {
-            if (UC[k][l] == 1) {
-              if (userRoleCount[k] < mrcUser - 1) {
-                printf("User %d\n", k);
-              }
-              if (permRoleCount[l] < mrcPerm - 1) {
-                printf("Permission %d\n", l);
-              }
-            }
-          }
-        }
-        break;
+static void initCandidateScan(CandidateScan *scan, RoleDraft *draft, UPA *UC,
+                              UPA *V, int *userRoleCount, int *permRoleCount) {
+  int dual = draft->vertex.type == PERMISSION;
+  scan->V = V;
+  scan->UC = UC;
+  scan->dual = dual;
+  scan->v = draft->vertex.index;
+  scan->set = dual ? draft->U : draft->P;
+  scan->setSize = 0;
+  scan->mrc = dual ? draft->mrcPerm : draft->mrcUser;
+  scan->roleCount = dual ? permRoleCount : userRoleCount;
+  scan->pivot = -1;
+  scan->candidates = dual ? V->permissionCount : V->userCount;
+  scan->accepted = draft->accepted;
+
+  if (V->sparse) {
+    // A user can only hold all of tempP if it holds its least assigned
+    // permission, so that permission's column lists every candidate. In the
+    // dual, only permissions of the tempU member with the fewest permissions
+    // can cover all of tempU.
+    int *touched = dual ? draft->touchedUsers : draft->touchedPerms;
+    int touchedCount = dual ? draft->touchedUserCount : draft->touchedPermCount;
+    for (int k = 0; k < touchedCount; k++) {
+      int j = touched[k];
+      if (!GET_BIT(scan->set, j)) {
+        continue;
+      }
+      int size = dual ? rowEnd(V, j) - rowStart(V, j)
+                      : columnEnd(V, j) - columnStart(V, j);
+      scan->setSize++;
+      if (scan->pivot == -1 || size < scan->candidates ||
+          (size == scan->candidates && j < scan->pivot)) {
+        scan->pivot = j;
+        scan->candidates = size;
       }
     }
-    if (roleCount == -1) {
-      break;
+  }
+}
+
+static int candidateAt(CandidateScan *scan, int c) {
+  if (scan->pivot == -1) {
+    return c;
+  }
+  return scan->dual
+             ? cellColumn(scan->V, rowStart(scan->V, scan->pivot) + c)
+             : cellRow(scan->V, columnStart(scan->V, scan->pivot) + c);
+}
+
+static int isCandidateAccepted(CandidateScan *scan, int i) {
+  UPA *V = scan->V, *UC = scan->UC;
+  int words = WORDS(scan->dual ? V->userCount : V->permissionCount);
+  int mrc = scan->mrc;
+  // The vertex itself was counted for the role before the scan.
+  int count = scan->roleCount[i] + (i == scan->v);
+
+  if (V->sparse) {
+    int inV, meetsUC, ucWithinSet;
+    if (scan->dual) {
+      classifySparseColumn(V, UC, i, scan->set, scan->setSize, &inV, &meetsUC,
+                           &ucWithinSet);
+    } else {
+      classifySparseRow(V, UC, i, scan->set, scan->setSize, &inV, &meetsUC,
+                        &ucWithinSet);
     }
+    return (i != scan->v && count < mrc - 1 && inV && meetsUC) ||
+           (count == mrc - 1 && inV && ucWithinSet);
   }
 
-  if (roleCount != -1) {
-    char uaFile[128], paFile[128];
-    sprintf(uaFile, "%s_UA.txt", dataset);
-    sprintf(paFile, "%s_PA.txt", dataset);
+  uint64_t *ucRow = ROW(scan->dual ? UC->transpose : UC->matrix, i);
+  uint64_t *vRow = ROW(scan->dual ? V->transpose : V->matrix, i);
+  return (i != scan->v && count < mrc - 1 && isSubset(scan->set, vRow, words) &&
+          hasElement(ucRow, scan->set, words)) ||
+         (count == mrc - 1 && isSubset(scan->set, vRow, words) &&
+          isSubset(ucRow, scan->set, words));
+}
 
-    writeMatrixToFile(uaMatrix, userCount, roleCount, uaFile);
-    writeMatrixTransposeToFile(paMatrix, permissionCount, roleCount, paFile);
+static void scanCandidates(void *arg, int worker, int workerCount) {
+  CandidateScan *scan = (CandidateScan *)arg;
+  int begin = (long)scan->candidates * worker / workerCount;
+  int end = (long)scan->candidates * (worker + 1) / workerCount;
+  for (int c = begin; c < end; c++) {
+    scan->accepted[c] = isCandidateAccepted(scan, candidateAt(scan, c));
   }
+}
 
-  freeMatrix(uaMatrix, userCount);
-  freeMatrix(paMatrix, permissionCount);
-  freeMatrix(UC, userCount);
+static void selectCandidates(CandidateScan *scan, RoleDraft *draft,
+                             WorkerPool *pool) {
+  if (pool != NULL && scan->candidates >= PARALLEL_SCAN_MIN_CANDIDATES) {
+    runOnPool(pool, scanCandidates, scan);
+  } else {
+    scanCandidates(scan, 0, 1);
+  }
 
-  return roleCount;
+  for (int c = 0; c < scan->candidates; c++) {
+    if (scan->accepted[c]) {
+      addDraftMember(draft, scan->dual, candidateAt(scan, c), 1);
+    }
+  }
 }
 
-int modifyUC(int **UC, int *U, int *P, int userCount, int permissionCount) {
-  int modifications = 0;
+// Drafts the role of vertex into draft, on top of whatever the caller has put
+// into it since resetting it.
+static void draftRole(RoleDraft *draft, Vertex vertex, UPA *UC, UPA *V,
+                      int mrcUser, int mrcPerm, int *userRoleCount,
+                      int *permRoleCount, int snapshot, WorkerPool *pool) {
+  int v = vertex.index;
 
-  for (int i = 0; i < userCount; i++) {
-    if (U[i] == 1) {
-      for (int j = 0; j < permissionCount; j++) {
-        if (P[j] == 1 && UC[i][j] == 1) {
-          UC[i][j] = 0;
-          modifications++;
-        }
+  draft->vertex = vertex;
+  draft->mrcUser = mrcUser;
+  draft->mrcPerm = mrcPerm;
+  draft->snapshot = snapshot;
+
+  CandidateScan scan;
+  if (vertex.type == USER) {
+    addDraftMember(draft, 0, v, 0);
+    for (int k = rowStart(UC, v); k < rowEnd(UC, v); k++) {
+      int j = cellColumn(UC, k);
+      if (isRowCellSet(UC, v, k) && permRoleCount[j] < mrcPerm - 1) {
+        addDraftMember(draft, 1, j, 1);
+      }
+    }
+  } else {
+    addDraftMember(draft, 1, v, 0);
+    for (int k = columnStart(UC, v); k < columnEnd(UC, v); k++) {
+      int i = cellRow(UC, k);
+      if (isColumnCellSet(UC, v, k) && userRoleCount[i] < mrcUser - 1) {
+        addDraftMember(draft, 0, i, 1);
       }
     }
   }
-  return modifications;
+  initCandidateScan(&scan, draft, UC, V, userRoleCount, permRoleCount);
+  selectCandidates(&scan, draft, pool);
 }
 
-int uniqueRole(int *U, int *P, int **uaMatrix, int **paMatrix, int userCount,
-               int roleCount, int permissionCount) {
-  for (int i = 0; i < roleCount; i++) {
-    int flag = 1;
-    for (int j = 0; j < userCount; j++) {
-      if (uaMatrix[j][i] != U[j]) {
-        flag = 0;
-        break;
+// Brings a draft up to date with the roles formed since it was made, assuming
+// it was started from empty U and P as in Phase 1. Those roles changed UC and
+// the role counts only at their own members, so the seed taken from the
+// vertex is checked again and only their members on the scanned side are
+// decided again. Returns 0 if the seed changed and the draft must be redone.
+static int reviseRoleDraft(RoleDraft *draft, UPA *UC, UPA *V,
+                           int *userRoleCount, int *permRoleCount,
+                           RoleStore *roles) {
+  int v = draft->vertex.index;
+  int dual = draft->vertex.type == PERMISSION;
+
+  if (draft->snapshot == roles->count) {
+    return 1;
+  }
+
+  if (dual) {
+    for (int k = columnStart(UC, v); k < columnEnd(UC, v); k++) {
+      int i = cellRow(UC, k);
+      int seeded =
+          isColumnCellSet(UC, v, k) && userRoleCount[i] < draft->mrcUser - 1;
+      if (seeded != (int)GET_BIT(draft->userRaised, i)) {
+        return 0;
       }
     }
-    for (int j = 0; j < permissionCount; j++) {
-      if (paMatrix[j][i] != P[j]) {
-        flag = 0;
-        break;
+  } else {
+    for (int k = rowStart(UC, v); k < rowEnd(UC, v); k++) {
+      int j = cellColumn(UC, k);
+      int seeded =
+          isRowCellSet(UC, v, k) && permRoleCount[j] < draft->mrcPerm - 1;
+      if (seeded != (int)GET_BIT(draft->permRaised, j)) {
+        return 0;
       }
     }
-    if (flag) {
-      return 0;
-    }
   }
-  return 1;
-}
 
-int isSetEmpty(int *a, int size) {
-  for (int i = 0; i < size; i++) {
-    if (a[i] == 1) {
-      return 0;
+  CandidateScan scan;
+  initCandidateScan(&scan, draft, UC, V, userRoleCount, permRoleCount);
+  uint64_t *selected = dual ? draft->P : draft->U;
+  uint64_t *raised = dual ? draft->permRaised : draft->userRaised;
+  int *offsets = dual ? roles->permOffsets : roles->userOffsets;
+  int *members = dual ? roles->permissions : roles->users;
+  for (int k = offsets[draft->snapshot]; k < offsets[roles->count]; k++) {
+    int i = members[k];
+    if (isCandidateAccepted(&scan, i)) {
+      addDraftMember(draft, dual, i, 1);
+    } else {
+      CLEAR_BIT(raised, i);
+      if (i != v) {
+        CLEAR_BIT(selected, i);
+      }
     }
   }
+  draft->snapshot = roles->count;
   return 1;
 }
 
-void addRoletoUA(int **uaMatrix, int *U, int userCount, int roleCount) {
+static void printDraftState(RoleDraft *draft, int *userRoleCount,
+                            int *permRoleCount, int userCount,
+                            int permissionCount) {
+  int *tempUserRoleCount = (int *)malloc((userCount + 1) * sizeof(int));
+  int *tempPermRoleCount = (int *)malloc((permissionCount + 1) * sizeof(int));
   for (int i = 0; i < userCount; i++) {
-    uaMatrix[i][roleCount - 1] = U[i];
+    tempUserRoleCount[i] =
+        userRoleCount[i] + (int)GET_BIT(draft->userRaised, i) +
+        (draft->vertex.type == USER && draft->vertex.index == i);
   }
-}
-
-void addRoletoPA(int **paMatrix, int *P, int permissionCount, int roleCount) {
   for (int j = 0; j < permissionCount; j++) {
-    paMatrix[j][roleCount - 1] = P[j];
+    tempPermRoleCount[j] =
+        permRoleCount[j] + (int)GET_BIT(draft->permRaised, j) +
+        (draft->vertex.type == PERMISSION && draft->vertex.index == j);
   }
+  printRoleState(draft->U, draft->P, tempUserRoleCount, tempPermRoleCount,
+                 userCount, permissionCount);
+  free(tempUserRoleCount);
+  free(tempPermRoleCount);
 }
 
-void formRoleProcedure(int v, int userCount, int permissionCount,
-                       int U[userCount], int P[permissionCount], int **UC,
-                       int **V, int mrcUser, int mrcPerm, int *userRoleCount,
-                       int *permRoleCount, int **uaMatrix, int **paMatrix,
-                       int *roleCount) {
+// Forms the drafted role unless its drafted side is empty or the role exists
+// already. Returns whether it was formed.
+static int commitRoleDraft(RoleDraft *draft, UPA *UC, DegreeIndex *degrees,
+                           RoleStore *roles) {
+  compactRoleDraft(draft);
+  if (draft->vertex.type == USER ? draft->touchedPermCount == 0
+                                 : draft->touchedUserCount == 0) {
+    if (LOG_ENABLED(LOG_DEBUG)) {
+      printDraftState(draft, degrees->userRoleCount, degrees->permRoleCount,
+                      UC->userCount, UC->permissionCount);
+    }
+    LOG(LOG_DEBUG, "%s\n",
+        draft->vertex.type == USER ? "Empty P set in formRoleProcedure"
+                                   : "Empty U set in dualFormRoleProcedure");
+    roles->empty++;
+    return 0;
+  }
 
-  int *tempPermRoleCount = (int *)malloc(permissionCount * sizeof(int));
-  int *tempUserRoleCount = (int *)malloc(userCount * sizeof(int));
-  int *tempU = (int *)malloc(userCount * sizeof(int));
-  int *tempP = (int *)malloc(permissionCount * sizeof(int));
-  memcpy(tempPermRoleCount, permRoleCount, permissionCount * sizeof(int));
-  memcpy(tempUserRoleCount, userRoleCount, userCount * sizeof(int));
-  memcpy(tempU, U, userCount * sizeof(int));
-  memcpy(tempP, P, permissionCount * sizeof(int));
+  uint64_t hash = hashRole(draft->touchedUsers, draft->touchedUserCount,
+                           draft->touchedPerms, draft->touchedPermCount);
+  if (!uniqueRole(draft->touchedUsers, draft->touchedUserCount,
+                  draft->touchedPerms, draft->touchedPermCount, hash, roles)) {
+    roles->duplicates++;
+    return 0;
+  }
 
-  tempU[v] = 1;
-  tempUserRoleCount[v] += 1;
+  commitRoleCounts(degrees, UC, draft);
+  addRole(roles, draft->touchedUsers, draft->touchedUserCount,
+          draft->touchedPerms, draft->touchedPermCount, hash);
+  return 1;
+}
 
-  for (int i = 0; i < permissionCount; i++) {
-    int p = UC[v][i];
-    printf("%d ", p);
-    if (p == 1 && tempPermRoleCount[i] < mrcPerm - 1) {
-      tempP[i] = 1;
-      tempPermRoleCount[i] += 1;
-    }
+static void printUncoveredRow(UPA *UC, int v) {
+  for (int k = rowStart(UC, v); k < rowEnd(UC, v); k++) {
+    printf("%d ", isRowCellSet(UC, v, k));
   }
   printf("\n");
+}
 
-  for (int i = 0; i < userCount; i++) {
-    if (i != v && tempUserRoleCount[i] < mrcUser - 1 &&
-        isSubset(tempP, V[i], permissionCount) &&
-        hasElement(UC[i], tempP, permissionCount)) {
-      tempU[i] = 1;
-      tempUserRoleCount[i] += 1;
-    } else if (tempUserRoleCount[i] == mrcUser - 1 &&
-               isSubset(tempP, V[i], permissionCount) &&
-               isSubset(UC[i], tempP, permissionCount)) {
-      tempU[i] = 1;
-      tempUserRoleCount[i] += 1;
-    }
-  }
+// Forms the role of user v in draft, which may already hold members the
+// caller put there. Returns draft if the role was formed, else NULL.
+static RoleDraft *formRoleProcedure(int v, UPA *UC, UPA *V, int mrcUser,
+                                    int mrcPerm, int *userRoleCount,
+                                    int *permRoleCount, DegreeIndex *degrees,
+                                    RoleStore *roles, RoleDraft *draft,
+                                    WorkerPool *pool) {
+  Vertex vertex = {v, USER};
 
-  if (isSetEmpty(tempP, permissionCount)) {
-    printf("U: \n");
-    for (int i = 0; i < userCount; i++) {
-      printf("%d ", tempU[i]);
-    }
-    printf("\nP: \n");
-    for (int i = 0; i < permissionCount; i++) {
-      printf("%d ", tempP[i]);
-    }
-    printf("\nUser role count: \n");
-    for (int i = 0; i < userCount; i++) {
-      printf("%d ", tempUserRoleCount[i]);
-    }
-    printf("\nPermission role count: \n");
-    for (int i = 0; i < permissionCount; i++) {
-      printf("%d ", tempPermRoleCount[i]);
-    }
-    printf("\n");
-    free(tempPermRoleCount);
-    free(tempUserRoleCount);
-    free(tempU);
-    free(tempP);
-    perror("Empty P set in formRoleProcedure");
-    return;
+  if (LOG_ENABLED(LOG_TRACE)) {
+    printUncoveredRow(UC, v);
   }
+  draftRole(draft, vertex, UC, V, mrcUser, mrcPerm, userRoleCount,
+            permRoleCount, roles->count, pool);
+  return commitRoleDraft(draft, UC, degrees, roles) ? draft : NULL;
+}
 
-  if (!uniqueRole(tempU, tempP, uaMatrix, paMatrix, userCount, *roleCount,
-                  permissionCount)) {
-    /* for (int i = 0; i < userCount; i++) { */
-    /*   printf("%d ", U[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < permissionCount; i++) { */
-    /*   printf("%d ", tempP[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < userCount; i++) { */
-    /*   printf("%d ", tempUserRoleCount[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < permissionCount; i++) { */
-    /*   printf("%d ", tempPermRoleCount[i]); */
-    /* } */
-    /* printf("\n"); */
-    free(tempPermRoleCount);
-    free(tempUserRoleCount);
-    free(tempU);
-    free(tempP);
-    return;
-  }
+static RoleDraft *dualFormRoleProcedure(int v, UPA *UC, UPA *V, int mrcUser,
+                                        int mrcPerm, int *userRoleCount,
+                                        int *permRoleCount,
+                                        DegreeIndex *degrees, RoleStore *roles,
+                                        RoleDraft *draft, WorkerPool *pool) {
+  Vertex vertex = {v, PERMISSION};
 
-  memcpy(userRoleCount, tempUserRoleCount, userCount * sizeof(int));
-  memcpy(permRoleCount, tempPermRoleCount, permissionCount * sizeof(int));
-  memcpy(U, tempU, userCount * sizeof(int));
-  memcpy(P, tempP, permissionCount * sizeof(int));
+  draftRole(draft, vertex, UC, V, mrcUser, mrcPerm, userRoleCount,
+            permRoleCount, roles->count, pool);
+  return commitRoleDraft(draft, UC, degrees, roles) ? draft : NULL;
+}
 
-  *roleCount += 1;
+static Speculation *createSpeculation(ScratchArena *arena, int depth, UPA *UC,
+                                      UPA *V, int mrcUser, int mrcPerm,
+                                      int *userRoleCount, int *permRoleCount) {
+  Speculation *speculation = (Speculation *)malloc(sizeof(Speculation));
+  speculation->depth = depth;
+  speculation->count = 0;
+  speculation->next = 0;
+  speculation->snapshot = 0;
+  speculation->vertices = (Vertex *)malloc(depth * sizeof(Vertex));
+  speculation->drafts = (RoleDraft **)malloc(depth * sizeof(RoleDraft *));
+  for (int d = 0; d < depth; d++) {
+    speculation->drafts[d] =
+        createRoleDraft(arena, UC->userCount, UC->permissionCount);
+  }
+  speculation->UC = UC;
+  speculation->V = V;
+  speculation->mrcUser = mrcUser;
+  speculation->mrcPerm = mrcPerm;
+  speculation->userRoleCount = userRoleCount;
+  speculation->permRoleCount = permRoleCount;
+  speculation->rounds = 0;
+  speculation->hits = 0;
+  speculation->redrafts = 0;
+  return speculation;
+}
 
-  addRoletoUA(uaMatrix, U, userCount, *roleCount);
-  addRoletoPA(paMatrix, P, permissionCount, *roleCount);
+static void freeSpeculation(Speculation *speculation) {
+  free(speculation->drafts);
+  free(speculation->vertices);
+  free(speculation);
+}
 
-  free(tempPermRoleCount);
-  free(tempUserRoleCount);
-  free(tempU);
-  free(tempP);
-}
-
-void dualFormRoleProcedure(int v, int *U, int *P, int **UC, int **V,
-                           int mrcUser, int mrcPerm, int *userRoleCount,
-                           int *permRoleCount, int **uaMatrix, int **paMatrix,
-                           int userCount, int permissionCount, int *roleCount) {
-  int *tempPermRoleCount = (int *)malloc(permissionCount * sizeof(int));
-  int *tempUserRoleCount = (int *)malloc(userCount * sizeof(int));
-  int *tempU = (int *)malloc(userCount * sizeof(int));
-  int *tempP = (int *)malloc(permissionCount * sizeof(int));
-  memcpy(tempPermRoleCount, permRoleCount, permissionCount * sizeof(int));
-  memcpy(tempUserRoleCount, userRoleCount, userCount * sizeof(int));
-  memcpy(tempU, U, userCount * sizeof(int));
-  memcpy(tempP, P, permissionCount * sizeof(int));
-
-  tempP[v] = 1;
-  tempPermRoleCount[v] += 1;
+// The count vertices selectVertexWithHeuristic would return, best first, if
+// each were removed in turn. Returns how many there are.
+static int nextVertices(DegreeIndex *degrees, Vertex *vertices, int count) {
+  TournamentTree *users = degrees->fewestUser, *perms = degrees->fewestPerm;
 
-  for (int i = 0; i < userCount; i++) {
-    int u = UC[i][v];
-    if (u == 1 && tempUserRoleCount[i] < mrcUser - 1) {
-      tempU[i] = 1;
-      tempUserRoleCount[i] += 1;
+  int found = 0;
+  while (found < count) {
+    int i = tournamentWinner(users);
+    int j = tournamentWinner(perms);
+    if (i == -1 && j == -1) {
+      break;
     }
+    // Users win ties against permissions.
+    if (i != -1 && (j == -1 || users->keys[i] <= perms->keys[j])) {
+      vertices[found].index = i;
+      vertices[found].type = USER;
+      updateTournamentTree(users, i, INT_MAX);
+    } else {
+      vertices[found].index = j;
+      vertices[found].type = PERMISSION;
+      updateTournamentTree(perms, j, INT_MAX);
+    }
+    found++;
   }
 
-  int **transposeV = (int **)malloc(permissionCount * sizeof(int *));
-  int **transposeUC = (int **)malloc(permissionCount * sizeof(int *));
-  for (int i = 0; i < permissionCount; i++) {
-    transposeV[i] = (int *)malloc(userCount * sizeof(int));
-    transposeUC[i] = (int *)malloc(userCount * sizeof(int));
-    for (int j = 0; j < userCount; j++) {
-      transposeV[i][j] = V[j][i];
-      transposeUC[i][j] = UC[j][i];
+  for (int d = 0; d < found; d++) {
+    int index = vertices[d].index;
+    if (vertices[d].type == USER) {
+      updateTournamentTree(users, index, fewestKey(degrees->userDegree[index]));
+    } else {
+      updateTournamentTree(perms, index, fewestKey(degrees->permDegree[index]));
     }
   }
+  return found;
+}
 
-  for (int i = 0; i < permissionCount; i++) {
-    if (i != v && tempPermRoleCount[i] < mrcPerm - 1 &&
-        isSubset(tempU, transposeV[i], userCount) &&
-        hasElement(transposeUC[i], tempU, userCount)) {
-      tempP[i] = 1;
-      tempPermRoleCount[i] += 1;
-    } else if (tempPermRoleCount[i] == mrcPerm - 1 &&
-               isSubset(tempU, transposeV[i], userCount) &&
-               isSubset(transposeUC[i], tempU, userCount)) {
-      tempP[i] = 1;
-      tempPermRoleCount[i] += 1;
-    }
+static void draftSpeculatively(void *arg, int worker, int workerCount) {
+  (void)worker;
+  (void)workerCount;
+  Speculation *speculation = (Speculation *)arg;
+  int d;
+  while ((d = __atomic_fetch_add(&speculation->next, 1, __ATOMIC_RELAXED)) <
+         speculation->count) {
+    Vertex vertex = speculation->vertices[d];
+    // Phase 1 forms permission roles with mrcPerm in place of mrcUser.
+    resetRoleDraft(speculation->drafts[d]);
+    draftRole(speculation->drafts[d], vertex, speculation->UC, speculation->V,
+              vertex.type == USER ? speculation->mrcUser : speculation->mrcPerm,
+              speculation->mrcPerm, speculation->userRoleCount,
+              speculation->permRoleCount, speculation->snapshot, NULL);
   }
+}
 
-  freeMatrix(transposeV, permissionCount);
-  freeMatrix(transposeUC, permissionCount);
+// Phase 1 counterpart of formRoleProcedure and dualFormRoleProcedure. The role
+// of vertex comes from a draft made ahead of time when there is one, revised
+// for the roles formed since. Otherwise the depth vertices that would be
+// selected next, vertex first, are drafted in parallel against the current
+// state. Roles are still committed one at a time in selection order, so the
+// result is the same as forming them one by one.
+static RoleDraft *speculativeFormRole(Speculation *speculation, Vertex vertex,
+                                      DegreeIndex *degrees, RoleStore *roles,
+                                      WorkerPool *pool) {
+  UPA *UC = speculation->UC;
 
-  if (isSetEmpty(tempU, userCount)) {
-    printf("U: \n");
-    for (int i = 0; i < userCount; i++) {
-      printf("%d ", tempU[i]);
-    }
-    printf("\nP: \n");
-    for (int i = 0; i < permissionCount; i++) {
-      printf("%d ", tempP[i]);
+  RoleDraft *draft = NULL;
+  for (int d = 0; d < speculation->count; d++) {
+    if (speculation->drafts[d]->vertex.index == vertex.index &&
+        speculation->drafts[d]->vertex.type == vertex.type) {
+      draft = speculation->drafts[d];
+      break;
     }
-    printf("\nUser role count: \n");
-    for (int i = 0; i < userCount; i++) {
-      printf("%d ", tempUserRoleCount[i]);
-    }
-    printf("\nPermission role count: \n");
-    for (int i = 0; i < permissionCount; i++) {
-      printf("%d ", tempPermRoleCount[i]);
-    }
-    printf("\n");
-    free(tempPermRoleCount);
-    free(tempUserRoleCount);
-    free(tempU);
-    free(tempP);
-    perror("Empty U set in dualFormRoleProcedure");
-    return;
   }
 
-  if (!uniqueRole(tempU, tempP, uaMatrix, paMatrix, userCount, *roleCount,
-                  permissionCount)) {
-    /* for (int i = 0; i < userCount; i++) { */
-    /*   printf("%d ", tempU[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < permissionCount; i++) { */
-    /*   printf("%d ", tempP[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < userCount; i++) { */
-    /*   printf("%d ", tempUserRoleCount[i]); */
-    /* } */
-    /* printf("\n"); */
-    /* for (int i = 0; i < permissionCount; i++) { */
-    /*   printf("%d ", tempPermRoleCount[i]); */
-    /* } */
-    /* printf("\n"); */
-    free(tempPermRoleCount);
-    free(tempUserRoleCount);
-    free(tempU);
-    free(tempP);
-    return;
+  if (draft == NULL) {
+    speculation->count =
+        nextVertices(degrees, speculation->vertices, speculation->depth);
+    speculation->next = 0;
+    speculation->snapshot = roles->count;
+    runOnPool(pool, draftSpeculatively, speculation);
+    draft = speculation->drafts[0];
+    speculation->rounds++;
+  } else if (!reviseRoleDraft(draft, UC, speculation->V,
+                              speculation->userRoleCount,
+                              speculation->permRoleCount, roles)) {
+    resetRoleDraft(draft);
+    draftRole(draft, vertex, UC, speculation->V,
+              vertex.type == USER ? speculation->mrcUser : speculation->mrcPerm,
+              speculation->mrcPerm, speculation->userRoleCount,
+              speculation->permRoleCount, roles->count, pool);
+    speculation->redrafts++;
+  } else {
+    speculation->hits++;
   }
 
-  memcpy(userRoleCount, tempUserRoleCount, userCount * sizeof(int));
-  memcpy(permRoleCount, tempPermRoleCount, permissionCount * sizeof(int));
-  memcpy(U, tempU, userCount * sizeof(int));
-  memcpy(P, tempP, permissionCount * sizeof(int));
-
-  *roleCount += 1;
-
-  addRoletoUA(uaMatrix, tempU, userCount, *roleCount);
-  addRoletoPA(paMatrix, tempP, permissionCount, *roleCount);
-
-  free(tempPermRoleCount);
-  free(tempUserRoleCount);
-  free(tempU);
-  free(tempP);
+  if (LOG_ENABLED(LOG_TRACE) && vertex.type == USER) {
+    printUncoveredRow(UC, vertex.index);
+  }
+  int formed = commitRoleDraft(draft, UC, degrees, roles);
+  draft->vertex.index = -1;
+  return formed ? draft : NULL;
 }
@@ -0,0 +1,89 @@
+#ifndef FRAMEWORK_H
+#define FRAMEWORK_H
+
+// The role miner as a library: framework.c built with -DFRAMEWORK_LIBRARY has
+// no main and makes only the calls below visible to the program it is linked
+// into.
+//
+// A context holds one UPA, loaded once, and mines it for any number of
+// constraint pairs in turn; the roles of the last run stay in it until the
+// next. The calls print nothing, write no files and do not exit: they return
+// -1 on failure, out of memory included, with the reason in getMiningError.
+// Contexts share nothing, so separate threads can use separate contexts.
+
+// With -K, checkpoints are written this often unless -i says otherwise.
+#define CHECKPOINT_SECONDS 600
+
+// Levels of the diagnostics, for progressLevel and -DLOG_LEVEL.
+#define LOG_QUIET 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+#define LOG_TRACE 3
+
+enum UPAFormat { AUTO, DENSE, SPARSE };
+
+// UA/PA output as dense 0/1 text, as a 1-based "row column" edge list in the
+// input format, or as a packed bitmap.
+enum OutputFormat { TEXT_OUTPUT, EDGE_OUTPUT, BINARY_OUTPUT };
+
+typedef struct Options {
+  enum UPAFormat format;
+  enum OutputFormat output;
+  int compress;
+  int threadCount;
+  int speculationDepth;
+  int jobCount;
+  int report;
+  int saveRoles;
+  char *snapshotFile;
+  int components;
+  int collapse;
+  char *deltaFile;
+  char *checkpointFile;
+  int checkpointRoles;
+  int checkpointSeconds;
+  int resume;
+  int progressLevel;
+} Options;
+
+#define DEFAULT_OPTIONS                                                        \
+  {AUTO, TEXT_OUTPUT, 0, 1, 1, 1, 0, 1, NULL, 0, 0, NULL, NULL, 0,             \
+   CHECKPOINT_SECONDS, 0, LOG_INFO}
+
+typedef struct MiningContext MiningContext;
+
+// Returns NULL if there is not enough memory. options may be NULL for the
+// defaults; the ones for files (-u, -K, -R) are ignored.
+MiningContext *createMiningContext(Options *options);
+
+// Loads a UPA file or snapshot into the context in place of its UPA.
+int loadMiningContext(MiningContext *context, char *fileName);
+
+// Gives the context the UPA with the given edges, as 0-based indices.
+int setMiningContextEdges(MiningContext *context, int userCount,
+                          int permissionCount, int edgeCount, int *edgeUsers,
+                          int *edgePermissions);
+
+// Returns the number of roles found, or -1 if the constraints cannot be met
+// or there is no UPA to mine.
+int runMiningContext(MiningContext *context, int mrcUser, int mrcPermission);
+
+// Points users and permissions at the sorted, 0-based members of role r of the
+// last run, which stay valid until the next run.
+int getMiningRole(MiningContext *context, int r, const int **users,
+                  int *userCount, const int **permissions,
+                  int *permissionCount);
+
+// The reason the last call that returned -1 failed.
+const char *getMiningError(MiningContext *context);
+
+// After a run that could not meet its constraints, the uncovered vertices as
+// the command line prints them; empty otherwise.
+const char *getMiningUnenforced(MiningContext *context);
+
+// Drops the UPA of the context and everything mined from it.
+void releaseMiningContext(MiningContext *context);
+
+void freeMiningContext(MiningContext *context);
+
+#endif